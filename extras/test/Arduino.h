@@ -0,0 +1,164 @@
+/*
+  Host-side stand-in for the parts of the Arduino SAMD core and CMSIS that
+  the library uses, so it can be compiled and tested on Linux. Registers are
+  plain structs; writing a CTRL command register hands the command to the
+  NVM controller model in nvm_model.cpp.
+*/
+
+#ifndef FLASHSTORAGE_TEST_ARDUINO_H
+#define FLASHSTORAGE_TEST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Interrupt masking
+extern int model_irq_depth;
+void model_irq_enabled();
+inline void noInterrupts() { model_irq_depth++; }
+inline void interrupts() { if (model_irq_depth > 0 && --model_irq_depth == 0) model_irq_enabled(); }
+inline uint32_t __get_PRIMASK() { return model_irq_depth > 0; }
+inline void __disable_irq() { model_irq_depth++; }
+inline void __enable_irq() { model_irq_depth = 0; model_irq_enabled(); }
+inline void __DSB() { }
+inline void __ISB() { }
+inline void __DMB() { }
+
+uint32_t micros();
+uint32_t millis();
+
+typedef int IRQn_Type;
+#define PERIPH_COUNT_IRQn 45
+
+// NVIC enable bits: ISER words set bits when written, ICER words clear them,
+// and both read back the enabled set
+extern uint32_t model_nvic_enabled[8];
+struct NvicWord {
+  uint32_t *word;
+  bool set;
+  operator uint32_t() const { return *word; }
+  NvicWord &operator=(uint32_t bits) { if (set) *word |= bits; else *word &= ~bits; return *this; }
+};
+struct NvicWords {
+  bool set;
+  NvicWord operator[](uint32_t i) const { NvicWord w = { &model_nvic_enabled[i], set }; return w; }
+};
+struct NVIC_Type { NvicWords ISER, ICER; };
+extern NVIC_Type model_nvic;
+#define NVIC (&model_nvic)
+inline void NVIC_EnableIRQ(IRQn_Type irq) { NVIC->ISER[irq >> 5] = 1UL << (irq & 31); }
+inline void NVIC_DisableIRQ(IRQn_Type irq) { NVIC->ICER[irq >> 5] = 1UL << (irq & 31); }
+
+#if defined(FLASHSTORAGE_RAMFUNC)
+// The host has no SRAM section to copy code into
+#define FLASHSTORAGE_RAMFUNC_ATTR __attribute__((noinline))
+#endif
+
+extern uint32_t SystemCoreClock;
+
+struct SCB_Type { uint32_t VTOR; uint32_t ICSR; };
+extern SCB_Type model_scb;
+#define SCB (&model_scb)
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+
+// SysTick counts down with the model's cycle counter, which only NVM
+// commands advance; its registers are computed when accessed
+struct SysTickVal {
+  operator uint32_t() const;
+  SysTickVal &operator=(uint32_t value);  // Any write clears the counter
+};
+struct SysTickLoad {
+  uint32_t value;
+  operator uint32_t() const;
+  SysTickLoad &operator=(uint32_t load);
+};
+struct SysTick_Type { uint32_t CTRL; SysTickLoad LOAD; SysTickVal VAL; };
+extern SysTick_Type model_systick;
+#define SysTick (&model_systick)
+#define SysTick_CTRL_TICKINT_Msk (1UL << 1)
+#define SysTick_LOAD_RELOAD_Msk 0xFFFFFFUL
+
+#if defined(__SAMD51__)
+struct DwtCycles { operator uint32_t() const; };
+struct DWT_Type { uint32_t CTRL; DwtCycles CYCCNT; };
+extern DWT_Type model_dwt;
+#define DWT (&model_dwt)
+#define DWT_CTRL_CYCCNTENA_Msk 1UL
+struct CoreDebug_Type { uint32_t DEMCR; };
+extern CoreDebug_Type model_coredebug;
+#define CoreDebug (&model_coredebug)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#endif
+
+// Writing the command register issues the command to the model
+void model_command(uint32_t cmd);
+struct ModelCommand {
+  volatile uint32_t value;
+  ModelCommand &operator=(uint32_t cmd) { value = cmd; model_command(cmd); return *this; }
+  operator uint32_t() const { return value; }
+};
+
+#if defined(__SAMD51__)
+struct Nvmctrl {
+  union { struct { uint32_t NVMP:16; uint32_t PSZ:3; uint32_t :12; uint32_t SEE:1; } bit; uint32_t reg; } PARAM;
+  union { struct { uint16_t :2; uint16_t WMODE:2; uint16_t PRM:2; uint16_t RWS:4; uint16_t AHBNS0:1; uint16_t AHBNS1:1;
+                   uint16_t CACHEDIS0:1; uint16_t CACHEDIS1:1; } bit; uint16_t reg; } CTRLA;
+  union { struct { uint16_t READY:1; uint16_t PRM:1; uint16_t LOAD:1; uint16_t SUSP:1; uint16_t AFIRST:1;
+                   uint16_t BPDIS:1; uint16_t :2; uint16_t BOOTPROT:4; } bit; uint16_t reg; } STATUS;
+  struct { ModelCommand reg; } CTRLB;
+  union { struct { uint16_t DONE:1; uint16_t ADDRE:1; uint16_t PROGE:1; uint16_t LOCKE:1; uint16_t ECCSE:1;
+                   uint16_t ECCDE:1; uint16_t NVME:1; uint16_t SUSP:1; uint16_t SEESFULL:1; uint16_t SEESOVF:1;
+                   uint16_t SEEWRC:1; } bit; uint16_t reg; } INTFLAG;
+  union { struct { uint16_t DONE:1; } bit; uint16_t reg; } INTENSET, INTENCLR;
+  struct { uint32_t reg; } ADDR;
+  union { struct { uint32_t ASEES:1; uint32_t LOAD:1; uint32_t BUSY:1; uint32_t LOCK:1; uint32_t RLOCK:1;
+                   uint32_t :3; uint32_t SBLK:4; uint32_t :4; uint32_t PSZ:3; } bit; uint32_t reg; } SEESTAT;
+  union { struct { uint8_t WMODE:1; uint8_t APRDIS:1; } bit; uint8_t reg; } SEECFG;
+};
+#define NVMCTRL_CTRLB_CMDEX_KEY 0xA500u
+#define NVMCTRL_CTRLB_CMD_EP 0x00u
+#define NVMCTRL_CTRLB_CMD_EB 0x01u
+#define NVMCTRL_CTRLB_CMD_WP 0x03u
+#define NVMCTRL_CTRLB_CMD_WQW 0x04u
+#define NVMCTRL_CTRLB_CMD_PBC 0x15u
+#define NVMCTRL_CTRLB_CMD_SEEFLUSH 0x33u
+#define NVMCTRL_INTFLAG_DONE 1u
+#define NVMCTRL_INTENSET_DONE 1u
+#define NVMCTRL_INTENCLR_DONE 1u
+#define NVMCTRL_0_IRQn 29
+#define SEEPROM_ADDR 0x44000000u
+
+struct Cmcc {
+  struct { struct { uint32_t CSTS:1; } bit; } SR;
+  struct { struct { uint32_t CEN:1; } bit; } CTRL;
+  struct { struct { uint32_t INVALL:1; } bit; } MAINT0;
+};
+extern Cmcc model_cmcc;
+#define CMCC (&model_cmcc)
+#else
+struct Nvmctrl {
+  struct { ModelCommand reg; } CTRLA;
+  union { struct { uint32_t :1; uint32_t RWS:4; uint32_t :2; uint32_t MANW:1; uint32_t SLEEPPRM:2; uint32_t :6;
+                   uint32_t READMODE:2; uint32_t CACHEDIS:1; } bit; uint32_t reg; } CTRLB;
+  union { struct { uint32_t NVMP:16; uint32_t PSZ:3; uint32_t :1; uint32_t RWWEEP:12; } bit; uint32_t reg; } PARAM;
+  union { struct { uint8_t READY:1; uint8_t ERROR:1; } bit; uint8_t reg; } INTENCLR, INTENSET, INTFLAG;
+  union { struct { uint16_t PRM:1; uint16_t LOAD:1; uint16_t PROGE:1; uint16_t LOCKE:1; uint16_t NVME:1; } bit; uint16_t reg; } STATUS;
+  struct { uint32_t reg; } ADDR;
+};
+#define NVMCTRL_CTRLA_CMDEX_KEY 0xA500u
+#define NVMCTRL_CTRLA_CMD_ER 0x02u
+#define NVMCTRL_CTRLA_CMD_WP 0x04u
+#define NVMCTRL_CTRLA_CMD_PBC 0x44u
+#define NVMCTRL_CTRLA_CMD_RWWEEER 0x1Au
+#define NVMCTRL_CTRLA_CMD_RWWEEWP 0x1Cu
+#define NVMCTRL_IRQn 5
+#define NVMCTRL_INTENSET_READY 1u
+#define NVMCTRL_INTENCLR_READY 1u
+#endif
+
+extern Nvmctrl model_nvmctrl;
+#define NVMCTRL (&model_nvmctrl)
+
+#endif // FLASHSTORAGE_TEST_ARDUINO_H
@@ -0,0 +1,419 @@
+/*
+  NVM controller model for the host tests, see nvm_model.h.
+*/
+
+#include "nvm_model.h"
+#include <sys/mman.h>
+#include <signal.h>
+
+int model_irq_depth = 0;
+uint32_t model_nvic_enabled[8];
+NVIC_Type model_nvic = { { true }, { false } };
+SCB_Type model_scb;
+SysTick_Type model_systick;
+Nvmctrl model_nvmctrl;
+#if defined(__SAMD51__)
+Cmcc model_cmcc;
+#endif
+
+uint8_t *model_flash = NULL;
+static uint8_t *programmed = NULL;  // Flash contents as of the last command
+
+// The RWWEE array, where the build has one, directly follows the main window
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+uint8_t *model_rwwee = NULL;
+static const uint32_t RWWEE_SIZE = MODEL_RWWEE_SIZE;
+#else
+static const uint32_t RWWEE_SIZE = 0;
+#endif
+static const uint32_t MAP_SIZE = MODEL_FLASH_SIZE + RWWEE_SIZE;
+
+int model_erases = 0;
+int model_programs = 0;
+int model_violations = 0;
+int model_fail_after = -1;
+static bool powered_off = false;
+int model_failures = 0;
+
+#if defined(__SAMD51__)
+uint32_t SystemCoreClock = 120000000;
+DWT_Type model_dwt;
+CoreDebug_Type model_coredebug;
+static const uint32_t ERASE_US = 50000, PROGRAM_US = 2500;
+#else
+uint32_t SystemCoreClock = 48000000;
+static const uint32_t ERASE_US = 6000, PROGRAM_US = 2500;
+#endif
+
+uint64_t model_cycles = 0;
+uint32_t model_ticks = 0;
+int model_systick_writes = 0;
+
+// SysTick: the counter reloaded to systick_top at cycle systick_reload
+static uint64_t systick_reload = 0;
+static uint32_t systick_top = 0;
+static bool systick_pending = false;
+
+static void systick_serve()
+{
+  if (model_irq_depth == 0 && (systick_pending || (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk))) {
+    systick_pending = false;
+    SCB->ICSR &= ~SCB_ICSR_PENDSTSET_Msk;
+    model_ticks++;
+  }
+}
+
+// Catch the counter up with model_cycles, taking every reload on the way
+static void systick_update()
+{
+  while (model_cycles - systick_reload > systick_top) {
+    systick_reload += (uint64_t)systick_top + 1;
+    systick_top = SysTick->LOAD.value;
+    if (SysTick->CTRL & SysTick_CTRL_TICKINT_Msk) {
+      systick_pending = true;
+      systick_serve();
+    }
+  }
+}
+
+SysTickVal::operator uint32_t() const
+{
+  systick_update();
+  return systick_top - (uint32_t)(model_cycles - systick_reload);
+}
+
+SysTickVal &SysTickVal::operator=(uint32_t)
+{
+  model_systick_writes++;
+  systick_update();
+  systick_reload = model_cycles;
+  systick_top = 0;  // Reloads from LOAD on the next cycle
+  return *this;
+}
+
+SysTickLoad::operator uint32_t() const { return value; }
+
+SysTickLoad &SysTickLoad::operator=(uint32_t load)
+{
+  model_systick_writes++;
+  systick_update();  // Periods already finished used the old value
+  value = load;
+  return *this;
+}
+
+#if defined(__SAMD51__)
+DwtCycles::operator uint32_t() const
+{
+  return (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) ? (uint32_t)model_cycles : 0;
+}
+#endif
+
+void model_advance_us(uint32_t us)
+{
+  model_cycles += (uint64_t)us * (SystemCoreClock / 1000000);
+  systick_update();
+}
+
+// Same arithmetic as the Arduino SAMD core
+uint32_t micros()
+{
+  uint32_t count = SysTick->VAL;
+  uint32_t pend = systick_pending || (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk);
+  return (model_ticks + pend) * 1000 + (SysTick->LOAD - count) / (SystemCoreClock / 1000000);
+}
+
+uint32_t millis() { return micros() / 1000; }
+
+// Peripheral interrupt lines attached by tests, raised during every NVM command
+static void (*irq_handlers[PERIPH_COUNT_IRQn])();
+static bool irq_pending[PERIPH_COUNT_IRQn];
+bool model_nvm_busy = false;
+
+void model_attach_irq(IRQn_Type irq, void (*handler)())
+{
+  irq_handlers[irq] = handler;
+}
+
+// Run the pending lines that are enabled, if interrupts are
+static void irq_serve()
+{
+  for (int irq = 0; irq < PERIPH_COUNT_IRQn && model_irq_depth == 0; irq++) {
+    if (irq_pending[irq] && (model_nvic_enabled[irq >> 5] & (1UL << (irq & 31)))) {
+      irq_pending[irq] = false;
+      irq_handlers[irq]();
+    }
+  }
+}
+
+void model_irq_enabled()
+{
+  systick_update();
+  systick_serve();
+  irq_serve();
+}
+
+// The window is kept read-only between commands. The first store to a host
+// page faults, and the handler opens that page and marks it dirty, so a
+// command only has to look at the pages filled since the previous one.
+// Pages hidden by model_watch_reads() fault on any access and open to
+// read-only, so a later store faults again and marks the page dirty.
+static const uint32_t HOST_PAGE = 4096;
+static bool dirty[MAP_SIZE / HOST_PAGE];
+static bool hidden[MAP_SIZE / HOST_PAGE];
+static bool touched[MAP_SIZE / HOST_PAGE];
+
+static void protect(uint32_t page, bool writable)
+{
+  mprotect(model_flash + page * HOST_PAGE, HOST_PAGE, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+}
+
+static void on_fault(int sig, siginfo_t *info, void *)
+{
+  uintptr_t addr = (uintptr_t)info->si_addr;
+  if (model_flash != NULL && addr >= (uintptr_t)model_flash && addr < (uintptr_t)model_flash + MAP_SIZE) {
+    uint32_t page = (addr - (uintptr_t)model_flash) / HOST_PAGE;
+    touched[page] = true;
+    if (hidden[page]) {
+      hidden[page] = false;
+      protect(page, false);
+      return;
+    }
+    dirty[page] = true;
+    protect(page, true);
+    return;
+  }
+  signal(sig, SIG_DFL);  // A real crash: fault again without the handler
+}
+
+void model_watch_reads()
+{
+  for (uint32_t page = 0; page < MAP_SIZE / HOST_PAGE; page++) {
+    touched[page] = false;
+    if (!dirty[page]) {
+      hidden[page] = true;
+      mprotect(model_flash + page * HOST_PAGE, HOST_PAGE, PROT_NONE);
+    }
+  }
+}
+
+bool model_was_read(const volatile void *addr)
+{
+  return touched[((uintptr_t)addr - (uintptr_t)model_flash) / HOST_PAGE];
+}
+
+// Bytes written into the page buffer since the last command are programmed
+// now. Programming can only clear bits; 0xFF bytes leave a cell alone. On
+// SAMD51 a 16-byte ECC quad-word can be programmed once per erase, so one
+// that changes must have been blank. The main array and the RWWEE array
+// each take only their own commands.
+static void program(bool rwwee)
+{
+  const uint32_t granule = FLASHSTORAGE_WRITE_GRANULE;
+  for (uint32_t page = 0; page < MAP_SIZE / HOST_PAGE; page++) {
+    if (!dirty[page]) {
+      continue;
+    }
+    if ((page * HOST_PAGE >= MODEL_FLASH_SIZE) != rwwee) {
+      model_violations++;
+      fprintf(stderr, "model: %s program command for +0x%x\n", rwwee ? "RWWEE" : "main array", page * HOST_PAGE);
+    }
+    for (uint32_t g = page * HOST_PAGE; g < (page + 1) * HOST_PAGE; g += granule) {
+      if (memcmp(model_flash + g, programmed + g, granule) == 0) {
+        continue;
+      }
+#if defined(__SAMD51__)
+      for (uint32_t i = g; i < g + granule; i++) {
+        if (programmed[i] != 0xFF) {
+          if (model_violations++ < 10) {
+            fprintf(stderr, "model: quad-word at +0x%x programmed twice\n", g);
+          }
+          break;
+        }
+      }
+#endif
+      for (uint32_t i = g; i < g + granule; i++) {
+        if ((model_flash[i] & ~programmed[i]) && model_flash[i] != 0xFF) {
+          if (model_violations++ < 10) {
+            fprintf(stderr, "model: program sets bits at +0x%x (%02x -> %02x)\n", i, programmed[i], model_flash[i]);
+          }
+        }
+        model_flash[i] &= programmed[i];
+        programmed[i] = model_flash[i];
+      }
+    }
+    dirty[page] = false;
+    protect(page, false);
+  }
+  model_programs++;
+}
+
+// Drop whatever was written since the last command
+static void discard()
+{
+  for (uint32_t page = 0; page < MAP_SIZE / HOST_PAGE; page++) {
+    if (dirty[page]) {
+      memcpy(model_flash + page * HOST_PAGE, programmed + page * HOST_PAGE, HOST_PAGE);
+      dirty[page] = false;
+      protect(page, false);
+    }
+  }
+}
+
+static void erase(uintptr_t addr, bool rwwee)
+{
+  uint32_t offset = addr - (uintptr_t)model_flash;
+  if (addr < (uintptr_t)model_flash || offset >= MAP_SIZE || offset % MODEL_ERASE_SIZE ||
+      (offset >= MODEL_FLASH_SIZE) != rwwee) {
+    model_violations++;
+    fprintf(stderr, "model: bad erase address 0x%lx\n", (unsigned long)addr);
+    return;
+  }
+  program(rwwee);  // Nothing may be pending in the page buffer
+  model_programs--;
+  for (uint32_t page = offset / HOST_PAGE; page * HOST_PAGE < offset + MODEL_ERASE_SIZE; page++) {
+    hidden[page] = false;  // The array erasing itself is not a read
+    protect(page, true);
+  }
+  memset(model_flash + offset, 0xFF, MODEL_ERASE_SIZE);
+  memset(programmed + offset, 0xFF, MODEL_ERASE_SIZE);
+  for (uint32_t page = offset / HOST_PAGE; page * HOST_PAGE < offset + MODEL_ERASE_SIZE; page++) {
+    protect(page, false);
+  }
+  model_erases++;
+}
+
+static void command_done()
+{
+#if defined(__SAMD51__)
+  NVMCTRL->INTFLAG.bit.DONE = 1;
+  NVMCTRL->STATUS.bit.READY = 1;
+#else
+  NVMCTRL->INTFLAG.bit.READY = 1;
+#endif
+}
+
+static void run_command(uint32_t cmd)
+{
+  if (model_fail_after >= 0 && model_fail_after-- == 0) {
+    powered_off = true;
+  }
+  if (powered_off) {
+    discard();  // Page buffer is lost and the command never runs
+    command_done();
+    return;
+  }
+  if ((cmd & 0xFF00) != 0xA500) {
+    model_violations++;
+    fprintf(stderr, "model: bad command key 0x%x\n", cmd);
+    return;
+  }
+
+  uint32_t command = cmd & 0x7F;
+#if defined(__SAMD51__)
+  if (command == NVMCTRL_CTRLB_CMD_EB) {
+    erase(NVMCTRL->ADDR.reg, false);
+    model_advance_us(ERASE_US);
+  } else if (command == NVMCTRL_CTRLB_CMD_WP || command == NVMCTRL_CTRLB_CMD_WQW) {
+    program(false);
+    model_advance_us(PROGRAM_US);
+  }
+#else
+  if (command == NVMCTRL_CTRLA_CMD_ER || command == NVMCTRL_CTRLA_CMD_RWWEEER) {
+    erase((uintptr_t)NVMCTRL->ADDR.reg << 1, command == NVMCTRL_CTRLA_CMD_RWWEEER);  // Word address
+    model_advance_us(ERASE_US);
+  } else if (command == NVMCTRL_CTRLA_CMD_WP || command == NVMCTRL_CTRLA_CMD_RWWEEWP) {
+    program(command == NVMCTRL_CTRLA_CMD_RWWEEWP);
+    model_advance_us(PROGRAM_US);
+  }
+#endif
+  command_done();
+}
+
+void model_command(uint32_t cmd)
+{
+  // Attached lines fire while the command runs; masked ones stay pending
+  model_nvm_busy = true;
+  for (int irq = 0; irq < PERIPH_COUNT_IRQn; irq++) {
+    irq_pending[irq] |= (irq_handlers[irq] != NULL);
+  }
+  irq_serve();
+  run_command(cmd);
+  model_nvm_busy = false;
+}
+
+void model_power_cycle()
+{
+  discard();
+  powered_off = false;
+  model_fail_after = -1;
+}
+
+void model_init()
+{
+  model_flash = (uint8_t *)mmap((void *)0x100000, MAP_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (model_flash == MAP_FAILED) {
+    perror("model: mmap flash");
+    exit(2);
+  }
+  programmed = (uint8_t *)malloc(MAP_SIZE);
+  memset(model_flash, 0, MAP_SIZE);
+  memset(programmed, 0, MAP_SIZE);
+  mprotect(model_flash, MAP_SIZE, PROT_READ);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_fault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, &action, NULL);
+
+  // Vector table in flash, as after reset
+  static uint32_t flash_vectors[16 + PERIPH_COUNT_IRQn];
+  for (uint32_t i = 0; i < 16 + PERIPH_COUNT_IRQn; i++) {
+    flash_vectors[i] = 0x1000 + i;
+  }
+  SCB->VTOR = (uint32_t)(uintptr_t)flash_vectors;
+
+  // 1ms tick, as configured by the core
+  SysTick->LOAD = SystemCoreClock / 1000 - 1;
+  SysTick->CTRL = SysTick_CTRL_TICKINT_Msk | 1;
+  systick_top = SysTick->LOAD;
+  model_systick_writes = 0;
+
+#if defined(__SAMD51__)
+  NVMCTRL->PARAM.bit.NVMP = 32768;  // 16MB of 512-byte pages, so the program
+                                   // and the window share the lower bank
+  NVMCTRL->PARAM.bit.PSZ = 6;
+  NVMCTRL->INTFLAG.bit.DONE = 1;
+  NVMCTRL->STATUS.bit.READY = 1;
+
+  // SmartEEPROM window as the fuses SBLK=1, PSZ=1 configure it (1KB)
+  if (mmap((void *)SEEPROM_ADDR, 65536, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == MAP_FAILED) {
+    perror("model: mmap SmartEEPROM");
+    exit(2);
+  }
+  memset((void *)SEEPROM_ADDR, 0xFF, 65536);
+  NVMCTRL->SEESTAT.bit.SBLK = 1;
+  NVMCTRL->SEESTAT.bit.PSZ = 1;
+#else
+  NVMCTRL->PARAM.bit.NVMP = 32768;  // 2MB of 64-byte pages, covering the window
+  NVMCTRL->PARAM.bit.PSZ = 3;
+  NVMCTRL->INTFLAG.bit.READY = 1;
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+  model_rwwee = model_flash + MODEL_FLASH_SIZE;
+  if ((uintptr_t)model_rwwee != NVMCTRL_RWW_EEPROM_ADDR) {
+    fprintf(stderr, "model: build with NVMCTRL_RWW_EEPROM_ADDR=0x%lx\n", (unsigned long)(uintptr_t)model_rwwee);
+    exit(2);
+  }
+  NVMCTRL->PARAM.bit.RWWEEP = RWWEE_SIZE / 64;
+#endif
+#endif
+}
+
+int model_report(const char *name)
+{
+  printf("%s: erases=%d programs=%d violations=%d failures=%d\n",
+         name, model_erases, model_programs, model_violations, model_failures);
+  return (model_violations != 0 || model_failures != 0) ? 1 : 0;
+}
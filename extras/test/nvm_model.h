@@ -0,0 +1,71 @@
+/*
+  NVM controller model and test helpers for the host tests. Flash is a
+  memory window at a fixed address that the library reads and fills through
+  the page buffer as on hardware; each command checks what changed since the
+  previous one against the rules of real flash.
+*/
+
+#ifndef FLASHSTORAGE_TEST_NVM_MODEL_H
+#define FLASHSTORAGE_TEST_NVM_MODEL_H
+
+#include "Arduino.h"
+#include "SAMD_SafeFlashStorage.h"
+
+#if defined(__SAMD51__)
+static const uint32_t MODEL_ERASE_SIZE = 8192;
+#else
+static const uint32_t MODEL_ERASE_SIZE = 256;
+#endif
+
+// Model flash window, zero-filled like the library's static arrays
+extern uint8_t *model_flash;
+static const uint32_t MODEL_FLASH_SIZE = 1UL << 20;
+
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+// SAMD21 RWWEE array, right after the main window at NVMCTRL_RWW_EEPROM_ADDR
+extern uint8_t *model_rwwee;
+static const uint32_t MODEL_RWWEE_SIZE = 8192;
+#endif
+
+extern int model_erases;      // Erase commands that reached the array
+extern int model_programs;    // Page program commands
+extern int model_violations;  // Programs that broke a flash rule
+
+// Cut the power once this many more commands have run: that command and
+// every later one are dropped, along with the page buffer, until
+// model_power_cycle(). The library keeps running on stale state, so a test
+// then discards its instances and mounts new ones, as after a reset. -1
+// disables.
+extern int model_fail_after;
+void model_power_cycle();
+
+// CPU cycles so far. NVM commands advance it by their typical duration,
+// and SysTick interrupts are served whenever interrupts are enabled.
+extern uint64_t model_cycles;
+extern uint32_t model_ticks;  // SysTick interrupts served, like the core's tick count
+extern int model_systick_writes;  // Writes to SysTick LOAD or VAL since model_init()
+void model_advance_us(uint32_t us);
+
+// Attach a handler to a peripheral interrupt line that fires while every NVM
+// command runs. It is served then if interrupts and the line are enabled, and
+// otherwise stays pending until they are. model_nvm_busy is true meanwhile.
+void model_attach_irq(IRQn_Type irq, void (*handler)());
+extern bool model_nvm_busy;
+
+// Hide every flash page not written since the last command, so the next
+// access to one marks it, and model_was_read() then tells whether the host
+// page (4KB) holding addr has been touched since
+void model_watch_reads();
+bool model_was_read(const volatile void *addr);
+
+void model_init();
+
+// Print the counters; returns the process exit status for main()
+int model_report(const char *name);
+
+extern int model_failures;
+#define CHECK(x) do { \
+    if (!(x)) { model_failures++; fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #x); } \
+  } while (0)
+
+#endif // FLASHSTORAGE_TEST_NVM_MODEL_H
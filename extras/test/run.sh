@@ -0,0 +1,52 @@
+#!/bin/sh
+# Build and run the host tests against the NVM controller model, as SAMD21,
+# as SAMD51, as a SAMD21 with an RWWEE array, and with FLASHSTORAGE_RAMFUNC.
+# Usage: extras/test/run.sh [test_name.cpp ...]
+dir=$(cd "$(dirname "$0")" && pwd)
+src="$dir/../../src"
+out="${TMPDIR:-/tmp}/flashstorage-tests"
+mkdir -p "$out"
+[ $# -gt 0 ] || set -- "$dir"/test_*.cpp
+
+# -fpermissive: the library casts pointers to 32-bit register values
+cxx="${CXX:-g++} -std=gnu++11 -O1 -g -Wall -Wextra -fpermissive -no-pie -I$dir -I$src"
+quiet="fpermissive\|loses precision\|^ *[0-9]* |\|^ *|\|In member function\|In function\|In instantiation\|required from"
+
+status=0
+for family in SAMD21 SAMD51 SAMD21-RWWEE SAMD21-RAMFUNC SAMD51-RAMFUNC; do
+  case $family in
+    SAMD21) flags="" ;;
+    SAMD51) flags="-D__SAMD51__" ;;
+    SAMD21-RWWEE) flags="-DNVMCTRL_RWW_EEPROM_ADDR=0x200000u" ;;  # Right after the model's window
+    SAMD21-RAMFUNC) flags="-DFLASHSTORAGE_RAMFUNC" ;;
+    SAMD51-RAMFUNC) flags="-D__SAMD51__ -DFLASHSTORAGE_RAMFUNC" ;;
+  esac
+
+  # Library and model once per configuration, in parallel
+  objs=""
+  for file in "$src"/*.cpp "$dir/nvm_model.cpp"; do
+    obj="$out/$(basename "$file" .cpp)-$family.o"
+    objs="$objs $obj"
+    $cxx $flags -c "$file" -o "$obj" 2>"$obj.log" &
+  done
+  wait
+  for obj in $objs; do
+    [ -f "$obj" ] || { cat "$obj.log"; echo "$family: BUILD FAILED"; exit 1; }
+    grep -v "$quiet" "$obj.log"
+  done
+
+  for test in "$@"; do
+    name=$(basename "$test" .cpp)
+    rm -f "$out/$name-$family"
+    if ! $cxx $flags "$dir/$name.cpp" $objs -o "$out/$name-$family" 2>"$out/$name-$family.log"; then
+      cat "$out/$name-$family.log"
+      echo "$name $family: BUILD FAILED"
+      status=1
+      continue
+    fi
+    grep -v "$quiet" "$out/$name-$family.log"
+    printf "%s " "$family"
+    "$out/$name-$family" || status=1
+  done
+done
+exit $status
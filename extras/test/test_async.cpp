@@ -0,0 +1,48 @@
+// Non-blocking operations, and blocking calls made while one is in flight
+#include "nvm_model.h"
+
+static int done = 0;
+static void count_done(void *) { done++; }
+
+int main()
+{
+  model_init();
+  uint8_t buf[1000];
+  for (int i = 0; i < 1000; i++) {
+    buf[i] = i * 7;
+  }
+
+  FlashClass f(model_flash, 4 * MODEL_ERASE_SIZE);
+  CHECK(f.beginErase(count_done, NULL));
+  CHECK(f.isBusy());
+  CHECK(!f.beginWrite(buf, count_done, NULL));  // One operation at a time
+  while (f.poll()) { }
+  CHECK(done == 1);
+  CHECK(f.isErased(model_flash, 4 * MODEL_ERASE_SIZE));
+
+  CHECK(f.beginWrite(model_flash + 4, buf, sizeof(buf), count_done, NULL));
+  while (f.poll()) { }
+  CHECK(done == 2);
+  CHECK(memcmp(model_flash + 4, buf, sizeof(buf)) == 0);
+
+  // A blocking call on another instance finishes the operation in flight
+  // (running its callback) before doing its own work
+  uint8_t *other = model_flash + 4 * MODEL_ERASE_SIZE;
+  FlashClass g(other, 4 * MODEL_ERASE_SIZE);
+  CHECK(g.erase());
+  CHECK(f.beginErase(count_done, NULL));
+  CHECK(g.write(other, buf, sizeof(buf)));
+  CHECK(done == 3);
+  CHECK(!f.isBusy());
+  CHECK(f.isErased(model_flash, 4 * MODEL_ERASE_SIZE));
+  CHECK(memcmp(other, buf, sizeof(buf)) == 0);
+
+  CHECK(f.beginWrite(model_flash, buf, sizeof(buf), count_done, NULL));
+  CHECK(g.erase());
+  CHECK(done == 4);
+  CHECK(memcmp(model_flash, buf, sizeof(buf)) == 0);
+  CHECK(g.isErased(other, 4 * MODEL_ERASE_SIZE));
+
+  CHECK(model_irq_depth == 0);
+  return model_report("async");
+}
@@ -0,0 +1,34 @@
+// Placement in the other SAMD51 flash bank, clear of SmartEEPROM
+#include "nvm_model.h"
+
+#if defined(__SAMD51__)
+int main()
+{
+  model_init();
+  // The model's 16MB array puts the program in the lower bank
+  const uintptr_t total = 16UL << 20;
+  CHECK((uintptr_t)&main < total / 2);
+
+  // SBLK=1: the last two blocks belong to SmartEEPROM
+  CHECK((uintptr_t)FlashClass::otherBankAddress(0, 8192) == total - 2 * 8192 - 8192);
+  CHECK((uintptr_t)FlashClass::otherBankAddress(8192, 16384) == total - 2 * 8192 - 8192 - 16384);
+
+  NVMCTRL->SEESTAT.bit.SBLK = 0;
+  CHECK((uintptr_t)FlashClass::otherBankAddress(0, 8192) == total - 8192);
+  CHECK(FlashClass::otherBankAddress(0, total / 2) != NULL);
+
+  NVMCTRL->SEESTAT.bit.SBLK = 10;
+  CHECK((uintptr_t)FlashClass::otherBankAddress(0, 8192) == total - 20 * 8192 - 8192);
+  CHECK(FlashClass::otherBankAddress(0, total / 2) == NULL);  // No longer fits
+  CHECK(FlashClass::otherBankAddress(0, total / 2 - 20 * 8192) != NULL);
+  CHECK(FlashClass::otherBankAddress(100, 8192) == NULL);  // Not block-aligned
+
+  return model_report("bank");
+}
+#else
+int main()
+{
+  printf("bank: SAMD51 only\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,57 @@
+// CachedFlashStorage: reads served from RAM, write-through, and reloading
+// after the region was erased behind its back
+#include "nvm_model.h"
+
+struct Gains {
+  float p, i, d;
+  uint32_t flags;
+};
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, MODEL_ERASE_SIZE).erase();
+
+  CachedFlashStorageClass<Gains> gains(model_flash, 0x2468, MODEL_ERASE_SIZE);
+  Gains g = { 1.5f, 0.25f, 0.125f, 7 }, r;
+  CHECK(!gains.read(&r));
+  CHECK(gains.write(g));
+
+  // Reads come from the RAM copy
+  model_watch_reads();
+  for (int i = 0; i < 10; i++) {
+    CHECK(gains.read(&r) && memcmp(&r, &g, sizeof(g)) == 0);
+    CHECK(gains.ref().flags == 7);
+  }
+  CHECK(!model_was_read(model_flash));
+
+  // An unchanged write touches neither flash nor the programs count
+  int programs = model_programs;
+  CHECK(gains.write(g));
+  CHECK(model_programs == programs);
+  CHECK(!model_was_read(model_flash));
+
+  // A changed one goes through to flash and into the copy
+  g.d = 0.5f;
+  CHECK(gains.write(g));
+  CHECK(model_programs > programs);
+  CHECK(gains.ref().d == 0.5f);
+  FlashStorageClass<Gains> plain(model_flash, 0x2468, MODEL_ERASE_SIZE);
+  CHECK(plain.read(&r) && memcmp(&r, &g, sizeof(g)) == 0);
+
+  // An erase by other means is only seen after invalidate()
+  FlashClass(model_flash, MODEL_ERASE_SIZE).erase();
+  CHECK(gains.read(&r) && r.d == 0.5f);
+  gains.invalidate();
+  CHECK(!gains.read(&r));
+  CHECK(gains.ref().flags == 0);
+
+  // ...and the same value is then written again rather than skipped
+  programs = model_programs;
+  CHECK(gains.write(g));
+  CHECK(model_programs > programs);
+  FlashStorageClass<Gains> after(model_flash, 0x2468, MODEL_ERASE_SIZE);
+  CHECK(after.read(&r) && memcmp(&r, &g, sizeof(g)) == 0);
+
+  return model_report("cached");
+}
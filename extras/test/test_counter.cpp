@@ -0,0 +1,40 @@
+// FlashCounter: increments, roll-over between units and remounting
+#include "nvm_model.h"
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, 2 * MODEL_ERASE_SIZE).erase();
+
+  FlashCounterClass counter(model_flash, 0x4321, MODEL_ERASE_SIZE);
+  uint32_t value = 0;
+  CHECK(!counter.read(&value));
+#if defined(__SAMD51__)
+  CHECK(counter.capacity() == (MODEL_ERASE_SIZE - 16) / 16);
+#else
+  CHECK(counter.capacity() == (MODEL_ERASE_SIZE - 8) * 8);
+#endif
+
+  // Single steps across several roll-overs
+  uint32_t expected = 0;
+  for (uint32_t i = 0; i < 3 * counter.capacity() + 7; i++) {
+    CHECK(counter.increment());
+    expected++;
+  }
+  CHECK(counter.read() == expected);
+  CHECK(model_erases >= 3);
+
+  // Bulk increments, including ones larger than what is left in a unit
+  CHECK(counter.increment(5));
+  CHECK(counter.increment(counter.capacity() + 3));
+  expected += 5 + counter.capacity() + 3;
+  CHECK(counter.read() == expected);
+
+  // A fresh instance (as after reset) finds the same count
+  FlashCounterClass again(model_flash, 0x4321, MODEL_ERASE_SIZE);
+  CHECK(again.read() == expected);
+  CHECK(again.increment());
+  CHECK(again.read() == expected + 1);
+
+  return model_report("counter");
+}
@@ -0,0 +1,65 @@
+// Interrupts-off windows of blocking operations are timed correctly even
+// though SysTick cannot be served while they last
+#include "nvm_model.h"
+
+int main()
+{
+  model_init();
+#if defined(__SAMD51__)
+  const uint32_t erase_us = 50000;
+#else
+  const uint32_t erase_us = 6000;
+#endif
+  FlashClass f(model_flash, 8 * MODEL_ERASE_SIZE);
+  uint8_t buf[64];
+  memset(buf, 0x5A, sizeof(buf));
+
+  // Without a limit the whole operation is one window, and nothing is timed,
+  // so SysTick is left alone
+  CHECK(f.erase());
+  for (uint32_t i = 0; i < 8; i++) {
+    CHECK(f.write(model_flash + i * MODEL_ERASE_SIZE, buf, sizeof(buf)));
+  }
+  FlashClass::resetInterruptsOffStats();
+  uint32_t ticks = model_ticks;
+  CHECK(f.erase());
+  CHECK(model_ticks - ticks <= 1);  // Only the tick pending at the end
+  CHECK(FlashClass::maxInterruptsOff() == 0);
+  CHECK(model_systick_writes == 0);
+
+  // A limit above the operation's length: still one window, now timed
+  // across eight erases, well past one SysTick period
+  for (uint32_t i = 0; i < 8; i++) {
+    CHECK(f.write(model_flash + i * MODEL_ERASE_SIZE, buf, sizeof(buf)));
+  }
+  FlashClass::setMaxCriticalSection(1000000);
+  FlashClass::resetInterruptsOffStats();
+  uint32_t before = micros();
+  CHECK(f.erase());
+  uint32_t after = micros();
+  CHECK(FlashClass::maxInterruptsOff() >= 8 * erase_us);
+  CHECK(FlashClass::maxInterruptsOff() < 8 * erase_us + 1000);
+  CHECK(after >= before);  // micros() stays monotonic, if behind
+  CHECK(model_irq_depth == 0);
+  CHECK(SysTick->LOAD == SystemCoreClock / 1000 - 1);
+
+  // With a limit, interrupts are served between erases
+  for (uint32_t i = 0; i < 8; i++) {
+    CHECK(f.write(model_flash + i * MODEL_ERASE_SIZE, buf, sizeof(buf)));
+  }
+  FlashClass::setMaxCriticalSection(1000);
+  FlashClass::resetInterruptsOffStats();
+  ticks = model_ticks;
+  CHECK(f.erase());
+  CHECK(FlashClass::maxInterruptsOff() >= erase_us);
+  CHECK(FlashClass::maxInterruptsOff() < erase_us + 1000);
+  CHECK(model_ticks - ticks >= 8);
+  FlashClass::setMaxCriticalSection(0);
+
+  // Time keeps counting normally afterwards
+  before = micros();
+  model_advance_us(5000);
+  CHECK(micros() - before >= 4900 && micros() - before <= 5100);
+
+  return model_report("critical");
+}
@@ -0,0 +1,70 @@
+// FlashEEPROM: patches of every length, compaction, remounting, and resets
+// mid-write
+#include "nvm_model.h"
+#include "FlashEEPROM.h"
+
+static const uint16_t SIZE = 512;
+static const uint32_t AREA = FLASHEEPROM_AREA_BYTES(SIZE, MODEL_ERASE_SIZE);
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, 2 * AREA).erase();
+
+  static uint8_t image[SIZE], image2[SIZE], expected[SIZE];
+  memset(expected, 0xFF, SIZE);
+  FlashEEPROMClass eeprom(model_flash, AREA, image, SIZE);
+
+  // Lengths from one byte to past MAX_PATCH, at every alignment
+  uint8_t data[300];
+  for (uint32_t i = 0; i < 600; i++) {
+    uint32_t len = 1 + (i * 37) % 299;
+    uint32_t index = (i * 101) % (SIZE - len);
+    for (uint32_t j = 0; j < len; j++) {
+      data[j] = (uint8_t)(i + j * 3);
+    }
+    CHECK(eeprom.writeBytes(index, data, len));
+    memcpy(expected + index, data, len);
+  }
+  CHECK(eeprom.commit());
+
+  FlashEEPROMClass again(model_flash, AREA, image2, SIZE);
+  uint8_t read[SIZE];
+  CHECK(again.readBytes(0, read, SIZE));
+  CHECK(memcmp(read, expected, SIZE) == 0);
+
+  // Reset in the middle of a write: afterwards every byte holds its old or
+  // its new value
+  for (uint32_t fail = 0; fail < 40; fail++) {
+    uint32_t len = 1 + (fail * 13) % 40;
+    uint32_t index = (fail * 29) % (SIZE - len);
+    for (uint32_t j = 0; j < len; j++) {
+      data[j] = (uint8_t)(expected[index + j] + 1);
+    }
+    {
+      FlashEEPROMClass before(model_flash, AREA, image, SIZE);
+      before.read(0);
+      model_fail_after = fail % 3;
+      before.writeBytes(index, data, len);
+      model_power_cycle();
+    }
+
+    FlashEEPROMClass after(model_flash, AREA, image2, SIZE);
+    CHECK(after.readBytes(0, read, SIZE));
+    for (uint32_t j = 0; j < SIZE; j++) {
+      bool patched = j >= index && j < index + len;
+      CHECK(read[j] == expected[j] || (patched && read[j] == data[j - index]));
+    }
+    memcpy(expected, read, SIZE);
+
+    // The next write after a torn patch still lands
+    CHECK(after.writeBytes(index, data, len) && after.commit());
+    memcpy(expected + index, data, len);
+  }
+
+  FlashEEPROMClass last(model_flash, AREA, image, SIZE);
+  CHECK(last.readBytes(0, read, SIZE));
+  CHECK(memcmp(read, expected, SIZE) == 0);
+
+  return model_report("eeprom");
+}
@@ -0,0 +1,42 @@
+// FlashClass erases: rows (SAMD21) or blocks (SAMD51) that already read back
+// blank are skipped, ones with any programmed word are not
+#include "nvm_model.h"
+
+int main()
+{
+  model_init();
+  FlashClass f(model_flash, 4 * MODEL_ERASE_SIZE);
+
+  // Zero-filled flash: every row needs its erase
+  CHECK(f.erase());
+  CHECK(model_erases == 4);
+  CHECK(f.isErased(model_flash, 4 * MODEL_ERASE_SIZE));
+
+  // Nothing programmed since, so nothing is erased again
+  CHECK(f.erase());
+  CHECK(model_erases == 4);
+
+  // A row programmed only in its last word is still erased, and so is one
+  // programmed only at its start; the blank rows between are skipped
+  uint8_t zero[FLASHSTORAGE_WRITE_GRANULE];
+  memset(zero, 0, sizeof(zero));
+  CHECK(f.write(model_flash + MODEL_ERASE_SIZE - sizeof(zero), zero, sizeof(zero)));
+  CHECK(f.write(model_flash + 3 * MODEL_ERASE_SIZE, zero, sizeof(zero)));
+  CHECK(f.erase());
+  CHECK(model_erases == 6);
+  CHECK(f.isErased(model_flash, 4 * MODEL_ERASE_SIZE));
+
+  // The non-blocking erase skips the same way
+  CHECK(f.write(model_flash + 2 * MODEL_ERASE_SIZE, zero, sizeof(zero)));
+  CHECK(f.beginErase());
+  while (f.poll()) { }
+  CHECK(model_erases == 7);
+  CHECK(f.isErased(model_flash, 4 * MODEL_ERASE_SIZE));
+
+  // A fully blank range completes without issuing any command
+  CHECK(f.beginErase());
+  while (f.poll()) { }
+  CHECK(model_erases == 7);
+
+  return model_report("erase");
+}
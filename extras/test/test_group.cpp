@@ -0,0 +1,60 @@
+// FlashStorageGroup: members of several sizes through appends, transactions,
+// compaction and remounting
+#include "nvm_model.h"
+#include "SAMD_SafeFlashStorage.h"
+
+struct Small { uint8_t b; };
+struct Odd { uint8_t b[7]; };
+struct Large { uint32_t w[10]; };
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, 2 * MODEL_ERASE_SIZE).erase();
+
+  FlashStorageGroupClass group(model_flash, MODEL_ERASE_SIZE);
+  FlashStorageMemberClass<Small> small(group, 0x1111);
+  FlashStorageMemberClass<Odd> odd(group, 0x2222);
+  FlashStorageMemberClass<Large> large(group, 0x3333);
+
+  Small s = {};
+  Odd o = {};
+  Large l = {};
+  for (uint32_t i = 0; i < 800; i++) {
+    switch (i % 3) {
+      case 0: s.b = (uint8_t)i; CHECK(small.write(s)); break;
+      case 1: memset(o.b, (uint8_t)i, sizeof(o.b)); CHECK(odd.write(o)); break;
+      default: l.w[i % 10] = i; CHECK(large.write(l)); break;
+    }
+  }
+
+  // Transactions leave staged records behind, which compaction rewrites as
+  // plain ones
+  for (uint32_t i = 0; i < 300; i++) {
+    FlashTxn txn;
+    s.b = (uint8_t)(i * 3);
+    memset(o.b, (uint8_t)(i * 5), sizeof(o.b));
+    l.w[i % 10] = i * 7;
+    CHECK(txn.stage(small, s));
+    CHECK(txn.stage(odd, o));
+    if (i % 2) {
+      CHECK(txn.stage(large, l));
+    } else {
+      CHECK(large.write(l));
+    }
+    CHECK(txn.commit());
+  }
+
+  FlashStorageGroupClass again(model_flash, MODEL_ERASE_SIZE);
+  FlashStorageMemberClass<Small> small2(again, 0x1111);
+  FlashStorageMemberClass<Odd> odd2(again, 0x2222);
+  FlashStorageMemberClass<Large> large2(again, 0x3333);
+  Small s2;
+  Odd o2;
+  Large l2;
+  CHECK(small2.read(&s2) && s2.b == s.b);
+  CHECK(odd2.read(&o2) && memcmp(&o2, &o, sizeof(o)) == 0);
+  CHECK(large2.read(&l2) && memcmp(&l2, &l, sizeof(l)) == 0);
+
+  return model_report("group");
+}
@@ -0,0 +1,96 @@
+// FlashKV: puts, removals and reclaims, remounting, and resets mid-write
+#include "nvm_model.h"
+#include "FlashKV.h"
+
+static const uint32_t UNITS = 3;
+static const uint32_t SLOTS = 40;
+
+static void key_name(char *key, uint32_t k)
+{
+  // Key lengths vary so records land at every offset within a granule
+  snprintf(key, 24, "key%u%.*s", k, (int)(k % 9), "xxxxxxxxx");
+}
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, UNITS * FLASHKV_UNIT_SIZE).erase();
+
+  static FlashKVIndexEntry index[SLOTS], index2[SLOTS];
+  FlashKVClass kv(model_flash, FLASHKV_UNIT_SIZE, UNITS, index, SLOTS);
+
+  uint32_t expected[16];
+  bool present[16] = {};
+  char key[24];
+  for (uint32_t i = 0; i < 2000; i++) {
+    uint32_t k = (i * 7) % 16;
+    key_name(key, k);
+    if (i % 11 == 5) {
+      CHECK(kv.remove(key));
+      present[k] = false;
+    } else {
+      uint8_t value[40];
+      memset(value, (uint8_t)i, sizeof(value));
+      memcpy(value, &i, sizeof(i));
+      CHECK(kv.put(key, value, 4 + (k % 5) * 9));
+      expected[k] = i;
+      present[k] = true;
+    }
+  }
+
+  FlashKVClass again(model_flash, FLASHKV_UNIT_SIZE, UNITS, index2, SLOTS);
+  uint32_t live = 0;
+  for (uint32_t k = 0; k < 16; k++) {
+    key_name(key, k);
+    CHECK(again.contains(key) == present[k]);
+    if (present[k]) {
+      uint8_t value[40];
+      CHECK(again.valueSize(key) == 4 + (k % 5) * 9);
+      CHECK(again.get(key, value, 4 + (k % 5) * 9));
+      uint32_t v;
+      memcpy(&v, value, sizeof(v));
+      CHECK(v == expected[k]);
+      live++;
+    }
+  }
+  CHECK(again.count() == live);
+
+  // Reset in the middle of a put: afterwards the key holds the old or the
+  // new value, and every other key is untouched
+  for (uint32_t k = 0; k < 16; k++) {
+    key_name(key, k);
+    CHECK(again.put(key, k));
+    expected[k] = k;
+  }
+  for (uint32_t fail = 0; fail < 60; fail++) {
+    uint32_t k = fail % 16;
+    uint32_t value = 100000 + fail;
+    bool reset = false;
+    {
+      FlashKVClass before(model_flash, FLASHKV_UNIT_SIZE, UNITS, index, SLOTS);
+      key_name(key, k);
+      model_fail_after = fail % 5;
+      bool stored = before.put(key, value);
+      reset = model_fail_after < 0;
+      CHECK(stored || reset);
+      model_power_cycle();
+    }
+
+    FlashKVClass after(model_flash, FLASHKV_UNIT_SIZE, UNITS, index2, SLOTS);
+    for (uint32_t other = 0; other < 16; other++) {
+      key_name(key, other);
+      uint32_t v = 0;
+      CHECK(after.get(key, &v));
+      if (other != k) {
+        CHECK(v == expected[other]);
+      } else if (!reset) {
+        CHECK(v == value);
+      } else {
+        CHECK(v == value || v == expected[other]);
+      }
+      expected[other] = v;
+    }
+  }
+
+  return model_report("kv");
+}
@@ -0,0 +1,66 @@
+// FlashKVLarge: the flash index through puts, removals, table rebuilds and
+// remounting
+#include "nvm_model.h"
+#include "FlashKV.h"
+
+static const uint32_t UNITS = 3;
+static const uint32_t MAX_KEYS = 24;
+static const uint32_t TABLE_BYTES = FLASHKV_TABLE_BYTES(MAX_KEYS, MODEL_ERASE_SIZE);
+
+static void key_name(char *key, uint32_t k)
+{
+  snprintf(key, 24, "key%u%.*s", k, (int)(k % 9), "xxxxxxxxx");
+}
+
+int main()
+{
+  model_init();
+  uint8_t *tables = model_flash + UNITS * FLASHKV_UNIT_SIZE;
+  FlashClass(model_flash, UNITS * FLASHKV_UNIT_SIZE + 2 * TABLE_BYTES).erase();
+
+  FlashKVLargeClass kv(model_flash, FLASHKV_UNIT_SIZE, UNITS, tables, TABLE_BYTES);
+
+  uint32_t expected[16];
+  bool present[16] = {};
+  char key[24];
+  for (uint32_t i = 0; i < 1500; i++) {
+    uint32_t k = (i * 7) % 16;
+    key_name(key, k);
+    if (i % 11 == 5) {
+      CHECK(kv.remove(key));
+      present[k] = false;
+    } else {
+      CHECK(kv.put(key, i));
+      expected[k] = i;
+      present[k] = true;
+    }
+  }
+
+  // A fresh instance finds the committed table instead of replaying the log
+  FlashKVLargeClass again(model_flash, FLASHKV_UNIT_SIZE, UNITS, tables, TABLE_BYTES);
+  uint32_t live = 0;
+  for (uint32_t k = 0; k < 16; k++) {
+    key_name(key, k);
+    CHECK(again.contains(key) == present[k]);
+    if (present[k]) {
+      uint32_t v = 0;
+      CHECK(again.get(key, &v));
+      CHECK(v == expected[k]);
+      live++;
+    }
+  }
+  CHECK(again.count() == live);
+
+  // With both tables lost the index is rebuilt from the log
+  FlashClass(tables, 2 * TABLE_BYTES).erase();
+  FlashKVLargeClass rebuilt(model_flash, FLASHKV_UNIT_SIZE, UNITS, tables, TABLE_BYTES);
+  for (uint32_t k = 0; k < 16; k++) {
+    key_name(key, k);
+    uint32_t v = 0;
+    CHECK(rebuilt.get(key, &v) == present[k]);
+    CHECK(!present[k] || v == expected[k]);
+  }
+  CHECK(rebuilt.count() == live);
+
+  return model_report("kvlarge");
+}
@@ -0,0 +1,51 @@
+// FlashClass::overwrite(): bit clearing, quad-word rules, and programming
+// only the granules that change
+#include "nvm_model.h"
+
+int main()
+{
+  model_init();
+  FlashClass f(model_flash, 2 * MODEL_ERASE_SIZE);
+  CHECK(f.erase());
+
+  uint8_t data[32];
+  memset(data, 0xF0, sizeof(data));
+  CHECK(f.write(model_flash, data, 16));
+
+  // Clearing more bits of programmed data
+  uint8_t less[16];
+  memset(less, 0x30, sizeof(less));
+#if defined(__SAMD51__)
+  CHECK(!f.canOverwrite(model_flash, less, 16));  // Quad-word already programmed
+  CHECK(!f.overwrite(model_flash, less, 16));
+  CHECK(model_flash[0] == 0xF0);
+#else
+  CHECK(f.overwrite(model_flash, less, 16));
+  CHECK(model_flash[0] == 0x30);
+#endif
+
+  // Setting bits is refused everywhere
+  uint8_t before = model_flash[0];
+  uint8_t more = before | 0x08;
+  CHECK(!f.overwrite(model_flash, &more, 1));
+  CHECK(model_flash[0] == before);
+
+  // Unchanged data and blank quad-words are fine everywhere
+  CHECK(f.overwrite(model_flash, model_flash, 16));
+  CHECK(f.overwrite(model_flash + 16, data, 16));
+  CHECK(memcmp(model_flash + 16, data, 16) == 0);
+
+  // Only the runs of granules that change are programmed: two changes three
+  // pages apart cost two page programs, not one for every page between
+  uint8_t *blank = model_flash + MODEL_ERASE_SIZE;
+  uint8_t span[4 * FLASHSTORAGE_PAGE_BYTES];
+  memset(span, 0xFF, sizeof(span));
+  span[0] = 0x00;
+  span[3 * FLASHSTORAGE_PAGE_BYTES + 1] = 0x5A;
+  int programs = model_programs;
+  CHECK(f.overwrite(blank, span, sizeof(span)));
+  CHECK(model_programs == programs + 2);
+  CHECK(memcmp(blank, span, sizeof(span)) == 0);
+
+  return model_report("overwrite");
+}
@@ -0,0 +1,74 @@
+// FLASHSTORAGE_RAMFUNC: commands run from SRAM with only the interrupts
+// allowed by allowDuringFlash() served while they are in flight
+#include "nvm_model.h"
+
+#if defined(FLASHSTORAGE_RAMFUNC)
+static const IRQn_Type ALLOWED_IRQ = 18;  // Like TC3 on SAMD21
+static const IRQn_Type OTHER_IRQ = 35;
+static int allowed_runs, allowed_during, other_runs, other_during;
+
+static void allowed_handler()
+{
+  allowed_runs++;
+  allowed_during += model_nvm_busy;
+}
+
+static void other_handler()
+{
+  other_runs++;
+  other_during += model_nvm_busy;
+}
+
+int main()
+{
+  model_init();
+  model_attach_irq(ALLOWED_IRQ, allowed_handler);
+  model_attach_irq(OTHER_IRQ, other_handler);
+  NVIC_EnableIRQ(ALLOWED_IRQ);
+  NVIC_EnableIRQ(OTHER_IRQ);
+
+  FlashClass f(model_flash, 4 * MODEL_ERASE_SIZE);
+  uint8_t buf[64];
+  memset(buf, 0x5A, sizeof(buf));
+
+  // Nothing allowed yet: interrupts stay off for the whole erase, and both
+  // lines are served once it is over
+  CHECK(f.erase());
+  CHECK(allowed_during == 0 && other_during == 0);
+  CHECK(allowed_runs == 1 && other_runs == 1);
+
+  // The vector table moves to SRAM, contents and all
+  const uint32_t *flash_vectors = (const uint32_t *)(uintptr_t)SCB->VTOR;
+  uint32_t reset_vector = flash_vectors[1];
+  FlashClass::relocateVectorTable();
+  CHECK((const uint32_t *)(uintptr_t)SCB->VTOR != flash_vectors);
+  CHECK(((const uint32_t *)(uintptr_t)SCB->VTOR)[1] == reset_vector);
+
+  // The allowed line runs during each erase; the other one waits for the end
+  // and is enabled again afterwards
+  FlashClass::allowDuringFlash(ALLOWED_IRQ);
+  for (uint32_t i = 0; i < 4; i++) {
+    CHECK(f.write(model_flash + i * MODEL_ERASE_SIZE, buf, sizeof(buf)));
+  }
+  allowed_runs = allowed_during = other_runs = other_during = 0;
+  int erases = model_erases;
+  CHECK(f.erase());
+  CHECK(model_erases - erases == 4);
+  CHECK(allowed_during >= 4);
+  CHECK(other_during == 0 && other_runs == 1);
+  CHECK(model_nvic_enabled[OTHER_IRQ >> 5] & (1UL << (OTHER_IRQ & 31)));
+  CHECK(model_irq_depth == 0);
+
+  // Writes still land
+  CHECK(f.write(model_flash, buf, sizeof(buf)));
+  CHECK(memcmp(model_flash, buf, sizeof(buf)) == 0);
+
+  return model_report("ramfunc");
+}
+#else
+int main()
+{
+  printf("ramfunc: FLASHSTORAGE_RAMFUNC only\n");
+  return 0;
+}
+#endif
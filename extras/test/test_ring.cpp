@@ -0,0 +1,67 @@
+// FlashStorageRing and FlashStorageAB with background erases from flashIdle()
+#include "nvm_model.h"
+
+struct Sample {
+  uint32_t seq;
+  uint16_t value;
+};
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, 6 * MODEL_ERASE_SIZE).erase();
+  uint8_t *ring_area = model_flash;
+  uint8_t *store_area = model_flash + 4 * MODEL_ERASE_SIZE;
+
+  FlashStorageRingClass<Sample> ring(ring_area, 0x5151, MODEL_ERASE_SIZE, 4, 1);
+  FlashStorageClass<Sample> store(store_area, 0x6262, MODEL_ERASE_SIZE);
+  Sample s = {}, r = {};
+
+  // Each flashIdle() call issues at most one erase and returns with it still
+  // marked in flight; writes to an unrelated variable must not fail meanwhile
+  const uint32_t writes = 4 * (MODEL_ERASE_SIZE / 16) + 50;
+  int pending = 0;
+  for (uint32_t i = 0; i < writes; i++) {
+    s.seq = i;
+    s.value = i * 3;
+    CHECK(ring.write(s));
+    pending += flashIdle();
+    CHECK(store.write(s));
+    CHECK(store.read(&r) && r.seq == i);
+    CHECK(ring.read(&r) && r.seq == i && r.value == (uint16_t)(i * 3));
+  }
+  CHECK(pending > 0);
+
+  // Once the erases are drained, a fresh instance finds the newest record
+  while (flashIdle()) { }
+  FlashStorageRingClass<Sample> again(ring_area, 0x5151, MODEL_ERASE_SIZE, 4);
+  CHECK(again.read(&r) && r.seq == writes - 1);
+
+  // Rewriting the newest value is recognised in place and programs nothing
+  int programs = model_programs;
+  CHECK(again.write(r));
+  CHECK(model_programs == programs);
+
+  // FlashStorageAB is a two-unit ring with one spare, so it keeps a
+  // background erase pending after almost every unit switch
+  uint8_t *ab_area = model_flash + 6 * MODEL_ERASE_SIZE;
+  FlashClass(ab_area, 2 * MODEL_ERASE_SIZE).erase();
+  FlashStorageRingClass<Sample> ab(ab_area, 0x7373, MODEL_ERASE_SIZE, 2, 1);
+  pending = 0;
+  for (uint32_t i = 0; i < writes; i++) {
+    s.seq = i;
+    s.value = i ^ 0x55;
+    CHECK(ab.write(s));
+    pending += flashIdle();
+    CHECK(store.write(s));
+    CHECK(store.read(&r) && r.seq == i);
+    CHECK(ab.read(&r) && r.seq == i && r.value == (uint16_t)(i ^ 0x55));
+  }
+  CHECK(pending > 0);
+  while (flashIdle()) { }
+  FlashStorageRingClass<Sample> ab_again(ab_area, 0x7373, MODEL_ERASE_SIZE, 2);
+  CHECK(ab_again.read(&r) && r.seq == writes - 1);
+
+  CHECK(model_irq_depth == 0);
+  return model_report("ring");
+}
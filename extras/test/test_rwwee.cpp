@@ -0,0 +1,67 @@
+// FlashStorageRWWEE: records in the SAMD21 RWWEE array, written with its own
+// commands, surviving resets, and refused where the array can't hold them
+#include "nvm_model.h"
+
+#if !defined(__SAMD51__) && defined(NVMCTRL_RWW_EEPROM_ADDR)
+struct Config {
+  uint32_t count;
+  uint8_t flags;
+  char label[11];
+};
+
+int main()
+{
+  model_init();
+  Config c = {}, r = {};
+  strcpy(c.label, "rwwee");
+
+  {
+    FlashStorageRWWEE(settings, Config, 2);
+    for (uint32_t i = 0; i < 40; i++) {
+      c.count = i;
+      CHECK(settings.write(c));
+      CHECK(settings.read(&r) && r.count == i && strcmp(r.label, "rwwee") == 0);
+    }
+    CHECK((const uint8_t *)settings.view() >= model_rwwee + 2 * 256 &&
+          (const uint8_t *)settings.view() < model_rwwee + 3 * 256);
+  }
+  CHECK(model_erases > 0);
+
+  // Reset in the middle of a write: the old or the new value survives, and
+  // only a cut between the erase and the rewrite of a full row loses both
+  for (uint32_t fail = 0; fail < 40; fail++) {
+    int erases = model_erases;
+    {
+      FlashStorageRWWEE(settings, Config, 2);
+      c.count = 1000 + fail;
+      model_fail_after = fail % 4;
+      settings.write(c);
+      model_power_cycle();
+    }
+    FlashStorageRWWEE(settings, Config, 2);
+    bool ok = settings.read(&r);
+    CHECK(ok || model_erases > erases);
+    CHECK(!ok || r.count == c.count || r.count == c.count - 1 || fail == 0 || model_erases > erases);
+    c.count = 1000 + fail;
+    CHECK(settings.write(c));
+  }
+
+  // A row past the end of the array is refused
+  FlashStorageRWWEE(toofar, Config, MODEL_RWWEE_SIZE / 256);
+  CHECK(!toofar.write(c));
+  CHECK(!toofar.read(&r));
+
+  // So is every row on a part whose array turns out to be absent
+  NVMCTRL->PARAM.bit.RWWEEP = 0;
+  FlashStorageRWWEE(absent, Config, 0);
+  CHECK(!absent.write(c));
+
+  return model_report("rwwee");
+}
+#else
+int main()
+{
+  printf("rwwee: SAMD21 with RWWEE only\n");
+  return 0;
+}
+#endif
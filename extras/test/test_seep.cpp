@@ -0,0 +1,74 @@
+// SmartEEPROM storage on SAMD51, against the SEESTAT fuses and lock bits
+#include "nvm_model.h"
+
+#if defined(__SAMD51__)
+struct Settings {
+  uint32_t id;
+  uint8_t mode;
+  char name[13];
+};
+
+struct Table {
+  uint16_t values[300];
+};
+
+int main()
+{
+  model_init();
+  CHECK(SmartEEPROMClass::capacity() == 1024);
+
+  FlashStorageSmartEEPROM(settings, Settings, 0);
+  FlashStorageSmartEEPROM(table, Table, 64);
+  Settings s = {}, r = {};
+  CHECK(!settings.read(&r));  // Blank
+
+  s.id = 42;
+  s.mode = 3;
+  strcpy(s.name, "pump");
+  CHECK(settings.write(s));
+  CHECK(settings.read(&r) && r.id == 42 && r.mode == 3 && strcmp(r.name, "pump") == 0);
+  CHECK(settings.write(s));  // Unchanged
+
+  // Another variable at the same offset does not see the record
+  SmartEEPROMStorageClass<Settings> other(0, 0x1234);
+  CHECK(!other.read(&r));
+
+  // A record larger than the write chunk
+  static Table t;
+  for (int i = 0; i < 300; i++) {
+    t.values[i] = i * 3;
+  }
+  CHECK(table.write(t));
+  static Table u;
+  CHECK(table.read(&u) && memcmp(&t, &u, sizeof(t)) == 0);
+  CHECK(settings.read(&r) && r.id == 42);
+
+  // Corruption is detected
+  ((volatile uint8_t *)SEEPROM_ADDR)[10] ^= 1;
+  CHECK(!settings.read(&r));
+  CHECK(settings.write(s));
+  CHECK(settings.read(&r) && r.id == 42);
+
+  // Out of range, locked and disabled SmartEEPROM are refused
+  SmartEEPROMStorageClass<Table> past_end(1024 - sizeof(Table) + 1, 0x1234);
+  CHECK(!past_end.write(t));
+  CHECK(!past_end.read(&u));
+  NVMCTRL->SEESTAT.bit.LOCK = 1;
+  s.id = 43;
+  CHECK(!settings.write(s));
+  NVMCTRL->SEESTAT.bit.LOCK = 0;
+  NVMCTRL->SEESTAT.bit.SBLK = 0;
+  CHECK(!settings.write(s));
+  CHECK(!settings.read(&r));
+  NVMCTRL->SEESTAT.bit.SBLK = 1;
+  CHECK(settings.read(&r) && r.id == 42);
+
+  return model_report("seep");
+}
+#else
+int main()
+{
+  printf("seep: SAMD51 only\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,51 @@
+// FlashStorageClass records: append, validation, skipped unchanged writes,
+// and the full-unit rewrite
+#include "nvm_model.h"
+
+struct Config {
+  uint32_t count;
+  uint8_t flags;
+  char label[9];
+};
+
+int main()
+{
+  model_init();
+  FlashClass(model_flash, MODEL_ERASE_SIZE).erase();
+
+  FlashStorageClass<Config> store(model_flash, 0x4242, MODEL_ERASE_SIZE);
+  Config c = {}, r = {};
+  CHECK(!store.read(&r));
+  CHECK(store.view() == NULL);
+
+  strcpy(c.label, "boot");
+  for (uint32_t i = 0; i < 100; i++) {
+    c.count = i;
+    CHECK(store.write(c));
+    CHECK(store.read(&r) && r.count == i && strcmp(r.label, "boot") == 0);
+  }
+
+  // A fresh instance (as after reset) finds the newest record
+  FlashStorageClass<Config> again(model_flash, 0x4242, MODEL_ERASE_SIZE);
+  CHECK(again.read(&r) && r.count == 99);
+  CHECK(again.ref().count == 99);
+
+  // An unchanged value is recognised from the checksum and fingerprint in
+  // RAM, without reading flash
+  int programs = model_programs;
+  model_watch_reads();
+  CHECK(store.write(c));
+  CHECK(model_programs == programs);
+  CHECK(!model_was_read(model_flash));
+
+  // The first write after reset compares with flash instead
+  CHECK(again.write(c));
+  CHECK(model_programs == programs);
+  CHECK(model_was_read(model_flash));
+
+  // Another variable does not accept the record
+  FlashStorageClass<Config> other(model_flash, 0x1111, MODEL_ERASE_SIZE);
+  CHECK(!other.read(&r));
+
+  return model_report("storage");
+}
@@ -0,0 +1,258 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "FlashEEPROM.h"
+#include <stddef.h>
+
+static const uint16_t AREA_MAGIC = 0x4545;  // "EE"
+
+// Image bytes staged in RAM per program during compaction
+static const uint32_t IMAGE_CHUNK = 64;
+
+FlashEEPROMClass::FlashEEPROMClass(const void *flash_addr, uint32_t area_bytes, uint8_t *image, uint16_t size) :
+  flash(flash_addr, 2 * area_bytes),
+  base((const volatile uint8_t *)flash_addr),
+  area_size(area_bytes),
+  image(image),
+  size(size),
+  mounted(false),
+  has_area(false),
+  failed(false),
+  active_area(0),
+  generation(0),
+  write_offset(0)
+{
+}
+
+uint16_t FlashEEPROMClass::patchCheck(const PatchHeader &header, const uint8_t *data)
+{
+  using namespace FlashStorageInternal;
+  return hash_combine(calcChecksum((const uint8_t *)&header, offsetof(PatchHeader, check)),
+                      calcChecksum(data, header.length));
+}
+
+bool FlashEEPROMClass::readArea(uint32_t area, uint32_t *area_generation)
+{
+  AreaHeader header;
+  if (!flash.read(areaAddress(area), &header, sizeof(AreaHeader)) ||
+      header.magic != AREA_MAGIC || header.size != size ||
+      header.checksum != FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation,
+                                                            sizeof(AreaHeader) - offsetof(AreaHeader, generation))) {
+    return false;  // Erased, never written, or interrupted during compaction
+  }
+  *area_generation = header.generation;
+  return true;
+}
+
+// Load the image of the newest area and replay its patches on top
+void FlashEEPROMClass::mount()
+{
+  uint32_t found;
+  has_area = false;
+  for (uint32_t area = 0; area < 2; area++) {
+    if (readArea(area, &found) && (!has_area || found > generation)) {
+      active_area = area;
+      generation = found;
+      has_area = true;
+    }
+  }
+
+  if (!has_area) {
+    memset(image, 0xFF, size);  // Blank, like a new EEPROM
+    mounted = true;
+    return;
+  }
+
+  const volatile uint8_t *area = areaAddress(active_area);
+  flash.read(area + AREA_HEADER_SIZE, image, size);
+
+  uint32_t offset = logStart();
+  while (offset + sizeof(PatchHeader) <= area_size) {
+    const volatile uint8_t *entry = area + offset;
+    if (flash.isErased(entry, sizeof(PatchHeader))) {
+      // Blank header ends the log, unless a reset left patch bytes behind it
+      if (!flash.isErased(entry, area_size - offset)) {
+        offset = area_size;
+      }
+      break;
+    }
+
+    PatchHeader header;
+    flash.read(entry, &header, sizeof(PatchHeader));
+    if (header.length == 0 || (uint32_t)header.offset + header.length > size ||
+        offset + patchSize(header.length) > area_size ||
+        header.check != patchCheck(header, (const uint8_t *)(entry + sizeof(PatchHeader)))) {
+      offset = area_size;  // Torn patch, the next write compacts
+      break;
+    }
+
+    flash.read(entry + sizeof(PatchHeader), image + header.offset, header.length);
+    offset += patchSize(header.length);
+  }
+  write_offset = offset;
+  mounted = true;
+}
+
+bool FlashEEPROMClass::append(uint32_t offset, const uint8_t *data, uint32_t len)
+{
+  PatchHeader header;
+  header.offset = (uint16_t)offset;
+  header.length = (uint16_t)len;
+  header.check = patchCheck(header, data);
+
+  // The header goes last, so a patch only shows up once complete. It shares
+  // its granule with the first patched bytes, which are programmed with it
+  // in one go; a patch within one granule is a single program.
+  const volatile uint8_t *entry = areaAddress(active_area) + write_offset;
+  FlashPart parts[] = {
+    { 0, &header, sizeof(PatchHeader) },
+    { sizeof(PatchHeader), data, len },
+  };
+  if (!flash.writeParts(entry, patchSize(len), parts, 2, sizeof(PatchHeader))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+
+  write_offset += patchSize(len);
+  return true;
+}
+
+// Write the image, with len bytes at offset replaced by data, to the other
+// area. Its header goes last, so the current area stays valid until then.
+bool FlashEEPROMClass::compact(uint32_t offset, const uint8_t *data, uint32_t len)
+{
+  uint32_t target = has_area ? 1 - active_area : 0;
+  const volatile uint8_t *area = areaAddress(target);
+  if (logStart() > area_size || !flash.erase(area, area_size)) {
+    mounted = false;
+    return false;
+  }
+
+  uint8_t chunk[IMAGE_CHUNK];
+  for (uint32_t pos = 0; pos < size; pos += IMAGE_CHUNK) {
+    uint32_t n = (size - pos < IMAGE_CHUNK) ? size - pos : IMAGE_CHUNK;
+    memcpy(chunk, image + pos, n);
+    for (uint32_t i = (offset > pos ? offset : pos); i < offset + len && i < pos + n; i++) {
+      chunk[i - pos] = data[i - offset];
+    }
+    if (!flash.write(area + AREA_HEADER_SIZE + pos, chunk, n)) {
+      mounted = false;
+      return false;
+    }
+  }
+
+  AreaHeader header;
+  header.magic = AREA_MAGIC;
+  header.generation = has_area ? generation + 1 : 0;
+  header.size = size;
+  header.checksum = FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation,
+                                                       sizeof(AreaHeader) - offsetof(AreaHeader, generation));
+  if (!flash.write(area, &header, sizeof(AreaHeader))) {
+    mounted = false;
+    return false;
+  }
+
+  active_area = target;
+  generation = header.generation;
+  has_area = true;
+  write_offset = logStart();
+  return true;
+}
+
+bool FlashEEPROMClass::readBytes(int index, void *data, uint32_t len)
+{
+  if (index < 0 || (uint32_t)index + len > size) {
+    return false;
+  }
+  if (!mounted) {
+    mount();
+  }
+  memcpy(data, image + index, len);
+  return true;
+}
+
+uint8_t FlashEEPROMClass::read(int index)
+{
+  uint8_t value = 0xFF;
+  readBytes(index, &value, 1);
+  return value;
+}
+
+bool FlashEEPROMClass::writeBytes(int index, const void *data, uint32_t len)
+{
+  if (index < 0 || (uint32_t)index + len > size) {
+    failed = true;
+    return false;
+  }
+  if (!mounted) {
+    mount();
+  }
+
+  // Only the span of bytes that changed is written
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint32_t first = 0, last = len;
+  while (first < len && image[index + first] == bytes[first]) {
+    first++;
+  }
+  if (first == len) {
+    return true;  // Unchanged, skip write to preserve flash endurance
+  }
+  while (image[index + last - 1] == bytes[last - 1]) {
+    last--;
+  }
+
+  uint32_t offset = index + first, len_left = last - first;
+  const uint8_t *src = bytes + first;
+
+  // Patches carry up to MAX_PATCH bytes. If they don't all fit in the log,
+  // compact instead, taking the new bytes along.
+  uint32_t needed = (len_left / MAX_PATCH) * patchSize(MAX_PATCH) +
+                    (len_left % MAX_PATCH ? patchSize(len_left % MAX_PATCH) : 0);
+  if (!has_area || write_offset + needed > area_size) {
+    if (!compact(offset, src, len_left)) {
+      failed = true;
+      return false;
+    }
+    memcpy(image + offset, src, len_left);
+    return true;
+  }
+
+  while (len_left > 0) {
+    uint32_t n = len_left < MAX_PATCH ? len_left : MAX_PATCH;
+    if (!append(offset, src, n)) {
+      failed = true;
+      return false;
+    }
+    memcpy(image + offset, src, n);
+    offset += n;
+    src += n;
+    len_left -= n;
+  }
+  return true;
+}
+
+bool FlashEEPROMClass::commit()
+{
+  if (!mounted) {
+    mount();
+  }
+  bool ok = !failed;
+  failed = false;
+  return ok;
+}
@@ -0,0 +1,169 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef FLASHEEPROM_H
+#define FLASHEEPROM_H
+
+#pragma once
+
+#include "SAMD_SafeFlashStorage.h"
+
+// Size of each of the two areas backing a 'size'-byte EEPROM: header, image
+// and at least as much again for the patch log, rounded up to the erase unit
+#define FLASHEEPROM_AREA_BYTES(size, erase_size) \
+  ((16 + 2 * (size) + (erase_size) - 1) / (erase_size) * (erase_size))
+
+#if defined(__SAMD51__)
+// Emulated EEPROM of 'size' bytes (up to 65535), e.g. FlashEEPROM(EEPROM, 1024)
+#define FlashEEPROM(name, size) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*FLASHEEPROM_AREA_BYTES(size, 8192)] = { }; \
+  static uint8_t FLASHSTORAGE_PPCAT(_image,name)[size]; \
+  FlashEEPROMClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHEEPROM_AREA_BYTES(size, 8192), \
+                        FLASHSTORAGE_PPCAT(_image,name), size);
+#else
+// Emulated EEPROM of 'size' bytes (up to 65535), e.g. FlashEEPROM(EEPROM, 1024)
+#define FlashEEPROM(name, size) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*FLASHEEPROM_AREA_BYTES(size, 256)] = { }; \
+  static uint8_t FLASHSTORAGE_PPCAT(_image,name)[size]; \
+  FlashEEPROMClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHEEPROM_AREA_BYTES(size, 256), \
+                        FLASHSTORAGE_PPCAT(_image,name), size);
+#endif
+
+class FlashEEPROMClass;
+
+// EEPROM[index] proxy, as in the AVR EEPROM library
+class FlashEEPROMRef {
+public:
+  FlashEEPROMRef(FlashEEPROMClass *eeprom, int index) : eeprom(eeprom), index(index) {}
+
+  operator uint8_t() const;
+  FlashEEPROMRef &operator=(uint8_t value);
+  FlashEEPROMRef &operator=(const FlashEEPROMRef &ref) { return *this = (uint8_t)ref; }
+  FlashEEPROMRef &update(uint8_t value) { return *this = value; }
+
+  FlashEEPROMRef &operator+=(uint8_t value) { return *this = (uint8_t)(*this + value); }
+  FlashEEPROMRef &operator-=(uint8_t value) { return *this = (uint8_t)(*this - value); }
+  FlashEEPROMRef &operator&=(uint8_t value) { return *this = (uint8_t)(*this & value); }
+  FlashEEPROMRef &operator|=(uint8_t value) { return *this = (uint8_t)(*this | value); }
+  FlashEEPROMRef &operator^=(uint8_t value) { return *this = (uint8_t)(*this ^ value); }
+  FlashEEPROMRef &operator++() { return *this += 1; }
+  FlashEEPROMRef &operator--() { return *this -= 1; }
+
+private:
+  FlashEEPROMClass *eeprom;
+  int index;
+};
+
+// Drop-in for the AVR EEPROM API (read/write/update/get/put/operator[]) on
+// flash. The contents live in a RAM image, so reads never touch flash. A
+// write appends a patch holding only the changed bytes to the log of the
+// current area, which costs a few word programs and no erase. Once the log
+// is full, the image is written to the other area, whose header goes last,
+// so a reset at any point leaves the previous contents readable. The log is
+// replayed into RAM on first access.
+//
+// Writes reach flash immediately, so commit() is not needed; it only
+// reports whether they all succeeded. Unwritten bytes read as 0xFF.
+//
+// WARNING: Not interrupt-safe or thread-safe, same as FlashClass.
+class FlashEEPROMClass {
+public:
+  FlashEEPROMClass(const void *flash_addr, uint32_t area_bytes, uint8_t *image, uint16_t size);
+
+  uint8_t read(int index);
+
+  // Both skip the write if the value is unchanged, to preserve flash endurance
+  void write(int index, uint8_t value) { writeBytes(index, &value, 1); }
+  void update(int index, uint8_t value) { writeBytes(index, &value, 1); }
+
+  template<class T> T &get(int index, T &value) {
+    readBytes(index, &value, sizeof(T));
+    return value;
+  }
+  template<class T> const T &put(int index, const T &value) {
+    writeBytes(index, &value, sizeof(T));
+    return value;
+  }
+
+  FlashEEPROMRef operator[](int index) { return FlashEEPROMRef(this, index); }
+
+  uint16_t length() const { return size; }
+
+  // Returns false if a write since the last commit() failed or was out of range
+  bool commit();
+
+  bool readBytes(int index, void *data, uint32_t len);
+  bool writeBytes(int index, const void *data, uint32_t len);
+
+private:
+  struct AreaHeader {
+    uint16_t magic;
+    uint16_t checksum;    // Covers generation and size
+    uint32_t generation;  // Increases with every compaction
+    uint32_t size;
+  };
+
+  // A patch header is followed by its bytes and padded to the program granule
+  struct PatchHeader {
+    uint16_t offset;
+    uint16_t length;
+    uint16_t check;       // Covers offset, length and the patched bytes
+  };
+
+  static const uint32_t AREA_HEADER_SIZE =
+    (sizeof(AreaHeader) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  static const uint32_t MAX_PATCH = 255;
+
+  static uint32_t patchSize(uint32_t length) {
+    return (sizeof(PatchHeader) + length + FLASHSTORAGE_WRITE_GRANULE - 1) /
+           FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+  static uint16_t patchCheck(const PatchHeader &header, const uint8_t *data);
+
+  const volatile uint8_t *areaAddress(uint32_t area) const { return base + area * area_size; }
+  uint32_t logStart() const {
+    return (AREA_HEADER_SIZE + size + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+
+  void mount();
+  bool readArea(uint32_t area, uint32_t *generation);
+  bool append(uint32_t offset, const uint8_t *data, uint32_t len);
+  bool compact(uint32_t offset, const uint8_t *data, uint32_t len);
+
+  FlashClass flash;
+  const volatile uint8_t *base;
+  const uint32_t area_size;
+  uint8_t *image;
+  const uint16_t size;
+
+  // Current area, found by mount()
+  bool mounted;
+  bool has_area;
+  bool failed;
+  uint32_t active_area;
+  uint32_t generation;
+  uint32_t write_offset;
+};
+
+inline FlashEEPROMRef::operator uint8_t() const { return eeprom->read(index); }
+inline FlashEEPROMRef &FlashEEPROMRef::operator=(uint8_t value) { eeprom->update(index, value); return *this; }
+
+#endif // FLASHEEPROM_H
@@ -0,0 +1,810 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "FlashKV.h"
+#include <stddef.h>
+
+static const uint16_t UNIT_MAGIC = 0x4B56;  // "KV"
+
+FlashKVClass::FlashKVClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units,
+                           FlashKVIndexEntry *index_table, uint32_t index_slots) :
+  flash(flash_addr, unit_bytes * units),
+  base((const volatile uint8_t *)flash_addr),
+  unit_size(unit_bytes),
+  unit_count(units),
+  index(index_table),
+  index_slots(index_slots),
+  index_count(0),
+  mounted(false),
+  has_active(false),
+  active_unit(0),
+  write_offset(0),
+  next_generation(0)
+{
+}
+
+uint16_t FlashKVClass::recordChecksum(const RecordHeader &header, const uint8_t *key, const uint8_t *value)
+{
+  using namespace FlashStorageInternal;
+  uint16_t sum = calcChecksum((const uint8_t *)&header, offsetof(RecordHeader, checksum));
+  sum = hash_combine(sum, calcChecksum(key, header.key_len));
+  return hash_combine(sum, calcChecksum(value, header.value_len));
+}
+
+// Runtime equivalent of FlashStorageInternal::hash_string()
+uint16_t FlashKVClass::keyHash(const char *key, uint8_t key_len)
+{
+  uint16_t hash = 0x5A5A;
+  for (uint8_t i = 0; i < key_len; i++) {
+    hash = FlashStorageInternal::hash_combine(hash, (uint16_t)key[i]);
+  }
+  return hash;
+}
+
+bool FlashKVClass::prepare(const char *key, uint8_t *key_len)
+{
+  if (key == NULL || unit_count < 2) {
+    return false;
+  }
+
+  size_t len = strlen(key);
+  if (len == 0 || len > FLASHKV_MAX_KEY_LENGTH) {
+    return false;
+  }
+  *key_len = (uint8_t)len;
+
+  if (!mounted) {
+    mount();
+  }
+  return true;
+}
+
+bool FlashKVClass::readUnit(uint32_t unit, uint32_t *generation)
+{
+  UnitHeader header;
+  if (!flash.read(unitAddress(unit), &header, sizeof(UnitHeader)) ||
+      header.magic != UNIT_MAGIC ||
+      header.checksum != FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation, sizeof(uint32_t))) {
+    return false;  // Free: erased, never initialized, or interrupted while being opened
+  }
+  *generation = header.generation;
+  return true;
+}
+
+uint8_t FlashKVClass::readRecord(uint32_t unit, uint32_t offset, RecordHeader *header)
+{
+  if (offset + sizeof(RecordHeader) > unit_size) {
+    return RECORD_END;
+  }
+
+  const volatile uint8_t *record = unitAddress(unit) + offset;
+  if (flash.isErased(record, sizeof(RecordHeader))) {
+    // Blank header ends the log, unless a reset left a record body behind it
+    return flash.isErased(record, unit_size - offset) ? RECORD_END : RECORD_BROKEN;
+  }
+
+  flash.read(record, header, sizeof(RecordHeader));
+  if ((header->type != RECORD_VALUE && header->type != RECORD_REMOVED) ||
+      header->key_len == 0 || header->key_len > FLASHKV_MAX_KEY_LENGTH ||
+      offset + recordSize(header->key_len, header->value_len) > unit_size) {
+    return RECORD_BROKEN;  // Lengths can't be trusted, so the rest of the unit can't be walked
+  }
+
+  if (header->checksum != recordChecksum(*header, (const uint8_t *)(record + sizeof(RecordHeader)),
+                                         (const uint8_t *)(record + valueOffset(header->key_len)))) {
+    return RECORD_CORRUPT;
+  }
+  return RECORD_VALID;
+}
+
+bool FlashKVClass::keyMatches(uint32_t location, const char *key, uint8_t key_len)
+{
+  const volatile uint8_t *record = base + location;
+  return ((const volatile RecordHeader *)record)->key_len == key_len &&
+         memcmp((const void *)(record + sizeof(RecordHeader)), key, key_len) == 0;
+}
+
+bool FlashKVClass::readRecordAt(uint32_t location, RecordHeader *header)
+{
+  uint32_t unit = location / unit_size;
+  return unit < unit_count && readRecord(unit, location - unit * unit_size, header) == RECORD_VALID;
+}
+
+// Walk the records of one unit, applying them to the index if apply is set.
+// Returns the offset just past the last record, or unit_size if the unit
+// can't take more records.
+uint32_t FlashKVClass::replayUnit(uint32_t unit, bool apply)
+{
+  RecordHeader header;
+  uint32_t offset = UNIT_HEADER_SIZE;
+  while (true) {
+    uint8_t status = readRecord(unit, offset, &header);
+    if (status == RECORD_END) {
+      return offset;
+    }
+    if (status == RECORD_BROKEN) {
+      return unit_size;
+    }
+
+    if (apply && status == RECORD_VALID) {
+      const char *key = (const char *)(unitAddress(unit) + offset + sizeof(RecordHeader));
+      if (header.type == RECORD_VALUE) {
+        indexSet(key, header.key_len, header.key_hash, unit * unit_size + offset);
+      } else {
+        indexRemove(key, header.key_len, header.key_hash, unit * unit_size + offset);
+      }
+    }
+    offset += recordSize(header.key_len, header.value_len);
+  }
+}
+
+// Find the log head and, if the index asks for it, rebuild the index by
+// replaying units from oldest to newest so newer records override older ones
+void FlashKVClass::mount()
+{
+  // Records are appended to the newest unit
+  uint32_t newest = 0, generation;
+  has_active = false;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (readUnit(unit, &generation) && (!has_active || generation > newest)) {
+      active_unit = unit;
+      newest = generation;
+      has_active = true;
+    }
+  }
+  next_generation = has_active ? newest + 1 : 0;
+
+  bool replay = indexReset();
+  uint32_t last = 0;
+  bool first = true;
+  while (replay && has_active) {
+    uint32_t next = unit_count, next_found = 0;
+    for (uint32_t unit = 0; unit < unit_count; unit++) {
+      if (readUnit(unit, &generation) && (first || generation > last) && generation < newest &&
+          (next == unit_count || generation < next_found)) {
+        next = unit;
+        next_found = generation;
+      }
+    }
+    if (next == unit_count) {
+      break;
+    }
+    replayUnit(next, true);
+    last = next_found;
+    first = false;
+  }
+  if (has_active) {
+    write_offset = replayUnit(active_unit, replay);
+  }
+  if (replay) {
+    indexReplayed();
+  }
+  mounted = true;
+
+  // Only an interrupted reclaim() leaves no free unit. The newest unit then
+  // holds nothing but copies of records still intact in the oldest one, so
+  // drop it and let the next write reclaim again from the start.
+  if (has_active && countFree() == 0) {
+    if (flash.erase(unitAddress(active_unit), unit_size)) {
+      mount();
+    }
+  }
+}
+
+uint32_t FlashKVClass::freeUnit()
+{
+  uint32_t generation;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &generation)) {
+      return unit;
+    }
+  }
+  return unit_count;
+}
+
+uint32_t FlashKVClass::countFree()
+{
+  uint32_t count = 0, generation;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &generation)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+bool FlashKVClass::openFreeUnit()
+{
+  uint32_t unit = freeUnit();
+  if (unit == unit_count) {
+    return false;
+  }
+
+  UnitHeader header;
+  header.magic = UNIT_MAGIC;
+  header.generation = next_generation;
+  header.checksum = FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation, sizeof(uint32_t));
+
+  if (!flash.erase(unitAddress(unit), unit_size) || !flash.write(unitAddress(unit), &header, sizeof(UnitHeader))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+
+  next_generation++;
+  active_unit = unit;
+  has_active = true;
+  write_offset = UNIT_HEADER_SIZE;
+  return true;
+}
+
+// Only the newest record of a key is live. Older values and removal markers
+// have nothing left to override once their unit is reclaimed.
+bool FlashKVClass::isLive(uint32_t location, const RecordHeader &header)
+{
+  return header.type == RECORD_VALUE &&
+         indexFind((const char *)(base + location + sizeof(RecordHeader)), header.key_len, header.key_hash) == location;
+}
+
+// Copy the live records of the oldest unit forward, then erase it
+bool FlashKVClass::reclaim()
+{
+  uint32_t oldest = unit_count, oldest_generation = 0, generation;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (readUnit(unit, &generation) && (oldest == unit_count || generation < oldest_generation)) {
+      oldest = unit;
+      oldest_generation = generation;
+    }
+  }
+  if (oldest == unit_count) {
+    return false;
+  }
+
+  // Make room in the index for every copy up front, so the index is never
+  // reorganized while the unit is only partly copied
+  RecordHeader header;
+  uint32_t offset = UNIT_HEADER_SIZE, copies = 0;
+  while (true) {
+    uint8_t status = readRecord(oldest, offset, &header);
+    if (status == RECORD_END || status == RECORD_BROKEN) {
+      break;
+    }
+    if (status == RECORD_VALID && isLive(oldest * unit_size + offset, header)) {
+      copies++;
+    }
+    offset += recordSize(header.key_len, header.value_len);
+  }
+  if (!indexHasRoom(0, copies)) {
+    return false;
+  }
+
+  // Never copy a unit into itself
+  if (oldest == active_unit && !openFreeUnit()) {
+    return false;
+  }
+
+  offset = UNIT_HEADER_SIZE;
+  while (true) {
+    uint8_t status = readRecord(oldest, offset, &header);
+    if (status == RECORD_END || status == RECORD_BROKEN) {
+      break;
+    }
+
+    uint32_t size = recordSize(header.key_len, header.value_len);
+    uint32_t location = oldest * unit_size + offset;
+    const volatile uint8_t *src = base + location;
+
+    if (status == RECORD_VALID && isLive(location, header)) {
+      if (write_offset + size > unit_size && !openFreeUnit()) {
+        return false;
+      }
+
+      // Header last, same as append()
+      const volatile uint8_t *dst = unitAddress(active_unit) + write_offset;
+      FlashPart part = { 0, src, size };
+      if (!flash.writeParts(dst, size, &part, 1, sizeof(RecordHeader))) {
+        mounted = false;
+        return false;
+      }
+      write_offset += size;
+      if (!indexSet((const char *)(dst + sizeof(RecordHeader)), header.key_len, header.key_hash,
+                    active_unit * unit_size + write_offset - size)) {
+        return false;
+      }
+    }
+    offset += size;
+  }
+
+  if (!flash.erase(unitAddress(oldest), unit_size)) {
+    mounted = false;
+    return false;
+  }
+  return true;
+}
+
+bool FlashKVClass::ensureRoom(uint32_t size)
+{
+  for (uint32_t attempt = 0; attempt <= unit_count; attempt++) {
+    if (has_active && write_offset + size <= unit_size) {
+      return true;
+    }
+
+    // Keep one free unit in reserve for reclaim()
+    if (countFree() > (has_active ? 1U : 0U)) {
+      if (!openFreeUnit()) {
+        return false;
+      }
+    } else if (!reclaim()) {
+      return false;
+    }
+  }
+  return false;  // Every unit is full of live records
+}
+
+bool FlashKVClass::append(uint8_t type, const char *key, uint8_t key_len, uint16_t hash,
+                          const void *value, uint16_t value_len, uint32_t *location)
+{
+  uint32_t size = recordSize(key_len, value_len);
+  if (size > unit_size - UNIT_HEADER_SIZE || !ensureRoom(size)) {
+    return false;
+  }
+
+  RecordHeader header;
+  header.key_hash = hash;
+  header.key_len = key_len;
+  header.type = type;
+  header.value_len = value_len;
+  header.checksum = recordChecksum(header, (const uint8_t *)key, (const uint8_t *)value);
+
+  // The header goes last, so a record only shows up once it is complete.
+  // It shares its granule with the start of the key, which is programmed
+  // with it in one go.
+  const volatile uint8_t *record = unitAddress(active_unit) + write_offset;
+  FlashPart parts[] = {
+    { 0, &header, sizeof(RecordHeader) },
+    { sizeof(RecordHeader), key, key_len },
+    { valueOffset(key_len), value, value_len },
+  };
+  if (!flash.writeParts(record, size, parts, 3, sizeof(RecordHeader))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+
+  *location = active_unit * unit_size + write_offset;
+  write_offset += size;
+  return true;
+}
+
+bool FlashKVClass::put(const char *key, const void *value, uint16_t size)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint16_t hash = keyHash(key, key_len);
+  uint32_t existing = indexFind(key, key_len, hash);
+  if (existing != NO_RECORD) {
+    const volatile uint8_t *record = base + existing;
+    if (((const volatile RecordHeader *)record)->value_len == size &&
+        memcmp((const void *)(record + valueOffset(key_len)), value, size) == 0) {
+      return true;  // Value unchanged, skip write to preserve flash endurance
+    }
+  }
+  if (!indexHasRoom(existing == NO_RECORD ? 1 : 0, 1)) {
+    return false;  // Index full
+  }
+
+  uint32_t location;
+  return append(RECORD_VALUE, key, key_len, hash, value, size, &location) &&
+         indexSet(key, key_len, hash, location);
+}
+
+bool FlashKVClass::get(const char *key, void *value, uint16_t size)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint32_t location = indexFind(key, key_len, keyHash(key, key_len));
+  if (location == NO_RECORD) {
+    return false;
+  }
+
+  const volatile uint8_t *record = base + location;
+  if (((const volatile RecordHeader *)record)->value_len != size) {
+    return false;  // Stored under a different type or size
+  }
+  return flash.read(record + valueOffset(key_len), value, size);
+}
+
+bool FlashKVClass::remove(const char *key)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint16_t hash = keyHash(key, key_len);
+  if (indexFind(key, key_len, hash) == NO_RECORD) {
+    return true;  // Nothing to remove
+  }
+
+  uint32_t location;
+  return indexHasRoom(0, 1) &&
+         append(RECORD_REMOVED, key, key_len, hash, NULL, 0, &location) &&
+         indexRemove(key, key_len, hash, location);
+}
+
+bool FlashKVClass::contains(const char *key)
+{
+  uint8_t key_len;
+  return prepare(key, &key_len) && indexFind(key, key_len, keyHash(key, key_len)) != NO_RECORD;
+}
+
+uint16_t FlashKVClass::valueSize(const char *key)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return 0;
+  }
+
+  uint32_t location = indexFind(key, key_len, keyHash(key, key_len));
+  if (location == NO_RECORD) {
+    return 0;
+  }
+  return ((const volatile RecordHeader *)(base + location))->value_len;
+}
+
+uint32_t FlashKVClass::count()
+{
+  if (unit_count < 2) {
+    return 0;
+  }
+  if (!mounted) {
+    mount();
+  }
+  return indexCount();
+}
+
+bool FlashKVClass::indexReset()
+{
+  for (uint32_t i = 0; i < index_slots; i++) {
+    index[i].location = NO_RECORD;
+  }
+  index_count = 0;
+  return true;  // Always rebuilt from the log
+}
+
+uint32_t FlashKVClass::indexCount()
+{
+  return index_count;
+}
+
+bool FlashKVClass::indexHasRoom(uint32_t new_keys, uint32_t updates)
+{
+  (void)updates;  // Updates reuse the key's slot
+  return index_count + new_keys < index_slots;
+}
+
+void FlashKVClass::indexReplayed()
+{
+}
+
+uint32_t FlashKVClass::indexFind(const char *key, uint8_t key_len, uint16_t hash)
+{
+  return index_slots ? ramFind(key, key_len, hash, NULL) : NO_RECORD;
+}
+
+// Location of the newest record for key, or NO_RECORD. slot receives the
+// matching index slot, or the empty slot that ended the probe.
+uint32_t FlashKVClass::ramFind(const char *key, uint8_t key_len, uint16_t hash, uint32_t *slot)
+{
+  uint32_t i = hash % index_slots;
+  while (index[i].location != NO_RECORD) {
+    if (index[i].hash == hash && keyMatches(index[i].location, key, key_len)) {
+      break;
+    }
+    i = (i + 1 == index_slots) ? 0 : i + 1;
+  }
+
+  if (slot) {
+    *slot = i;
+  }
+  return index[i].location;
+}
+
+bool FlashKVClass::indexSet(const char *key, uint8_t key_len, uint16_t hash, uint32_t location)
+{
+  uint32_t slot;
+  if (index_slots == 0) {
+    return false;
+  }
+  if (ramFind(key, key_len, hash, &slot) == NO_RECORD) {
+    if (index_count + 1 >= index_slots) {
+      return false;  // Keep one slot empty so probes always terminate
+    }
+    index[slot].hash = hash;
+    index_count++;
+  }
+  index[slot].location = location;
+  return true;
+}
+
+bool FlashKVClass::indexRemove(const char *key, uint8_t key_len, uint16_t hash, uint32_t location)
+{
+  (void)location;  // The RAM index just forgets the key
+  uint32_t hole;
+  if (index_slots == 0 || ramFind(key, key_len, hash, &hole) == NO_RECORD) {
+    return true;
+  }
+
+  // Shift later entries of the probe run back into the hole, so lookups
+  // never stop early at an empty slot
+  uint32_t i = hole;
+  while (true) {
+    i = (i + 1 == index_slots) ? 0 : i + 1;
+    if (index[i].location == NO_RECORD) {
+      break;
+    }
+    uint32_t home = index[i].hash % index_slots;
+    bool movable = (hole <= i) ? (home <= hole || home > i) : (home <= hole && home > i);
+    if (movable) {
+      index[hole] = index[i];
+      hole = i;
+    }
+  }
+  index[hole].location = NO_RECORD;
+  index_count--;
+  return true;
+}
+
+static const uint16_t TABLE_MAGIC = 0x4B49;  // "KI"
+
+FlashKVLargeClass::FlashKVLargeClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units,
+                                     const void *table_addr, uint32_t table_bytes) :
+  FlashKVClass(flash_addr, unit_bytes, units, NULL, 0),
+  table_flash(table_addr, table_bytes * 2),
+  tables((const volatile uint8_t *)table_addr),
+  table_size(table_bytes),
+  slot_count((table_bytes - TABLE_HEADER_SIZE) / SLOT_SIZE),
+  has_table(false),
+  uncommitted(false),
+  active_table(0),
+  table_generation(0),
+  slots_used(0)
+{
+}
+
+bool FlashKVLargeClass::readTable(uint32_t table, uint32_t *generation)
+{
+  TableHeader header;
+  if (!table_flash.read(tableAddress(table), &header, sizeof(TableHeader)) ||
+      header.magic != TABLE_MAGIC ||
+      header.checksum != FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation, sizeof(uint32_t))) {
+    return false;
+  }
+  *generation = header.generation;
+  return true;
+}
+
+// Write the header that makes a fully built table the active one. While the
+// log is being replayed into a new table, the header waits for indexReplayed().
+bool FlashKVLargeClass::commitTable(uint32_t table, uint32_t generation)
+{
+  TableHeader header;
+  header.magic = TABLE_MAGIC;
+  header.generation = generation;
+  header.checksum = FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation, sizeof(uint32_t));
+  if (!uncommitted && !table_flash.write(tableAddress(table), &header, sizeof(TableHeader))) {
+    return false;
+  }
+
+  has_table = true;
+  active_table = table;
+  table_generation = generation;
+  return true;
+}
+
+// Slot of the newest entry for key in table, or slot_count if there is none.
+// Entries whose record no longer holds the key (the unit was reclaimed, or a
+// reset cut the write short) are skipped.
+uint32_t FlashKVLargeClass::findSlot(uint32_t table, const char *key, uint8_t key_len, uint16_t hash)
+{
+  uint32_t found = slot_count;
+  uint32_t i = hash % slot_count;
+  RecordHeader header;
+  for (uint32_t probes = 0; probes < slot_count; probes++) {
+    uint32_t slot = *slotAddress(table, i);
+    if (slot == EMPTY_SLOT) {
+      break;  // End of the probe run
+    }
+    if ((uint16_t)(slot >> 16) == hash && readRecordAt(slotLocation(slot), &header) &&
+        header.key_hash == hash && keyMatches(slotLocation(slot), key, key_len)) {
+      found = i;
+    }
+    i = (i + 1 == slot_count) ? 0 : i + 1;
+  }
+  return found;
+}
+
+// True if slot i of the active table is the newest entry for its key
+bool FlashKVLargeClass::isNewest(uint32_t i, uint8_t *type)
+{
+  uint32_t slot = *slotAddress(active_table, i);
+  RecordHeader header;
+  if (slot == EMPTY_SLOT || !readRecordAt(slotLocation(slot), &header)) {
+    return false;
+  }
+
+  const char *key = (const char *)(base + slotLocation(slot) + sizeof(RecordHeader));
+  *type = header.type;
+  return findSlot(active_table, key, header.key_len, (uint16_t)(slot >> 16)) == i;
+}
+
+// Program slot into the first empty slot of its probe run
+bool FlashKVLargeClass::insertSlot(uint32_t table, uint32_t slot)
+{
+  uint32_t i = (uint16_t)(slot >> 16) % slot_count;
+  for (uint32_t probes = 0; probes < slot_count; probes++) {
+    if (*slotAddress(table, i) == EMPTY_SLOT) {
+      // The rest of the slot's granule stays erased
+      return table_flash.write(slotAddress(table, i), &slot, sizeof(uint32_t));
+    }
+    i = (i + 1 == slot_count) ? 0 : i + 1;
+  }
+  return false;
+}
+
+// Copy the newest entry of every live key into the other table area. The old
+// table stays active until the new one's header is written.
+bool FlashKVLargeClass::rebuild()
+{
+  uint32_t target = active_table ^ 1;
+  if (!has_table || !table_flash.erase(tableAddress(target), table_size)) {
+    return false;
+  }
+
+  uint32_t used = 0;
+  uint8_t type;
+  for (uint32_t i = 0; i < slot_count; i++) {
+    // Removed keys are dropped along with superseded entries
+    if (isNewest(i, &type) && type == RECORD_VALUE) {
+      if (!insertSlot(target, *slotAddress(active_table, i))) {
+        return false;
+      }
+      used++;
+    }
+  }
+
+  if (!commitTable(target, table_generation + 1)) {
+    return false;
+  }
+  slots_used = used;
+  return true;
+}
+
+bool FlashKVLargeClass::addSlot(uint16_t hash, uint32_t location)
+{
+  if (!indexHasRoom(0, 1)) {
+    return false;
+  }
+  if (!insertSlot(active_table, ((uint32_t)hash << 16) | (location / FLASHSTORAGE_WRITE_GRANULE))) {
+    return false;
+  }
+  slots_used++;
+  return true;
+}
+
+bool FlashKVLargeClass::indexReset()
+{
+  has_table = false;
+  uint32_t generation;
+  for (uint32_t table = 0; table < 2; table++) {
+    if (readTable(table, &generation) && (!has_table || generation > table_generation)) {
+      has_table = true;
+      active_table = table;
+      table_generation = generation;
+    }
+  }
+  slots_used = 0;
+  if (!has_table) {
+    // No table yet (or both lost): replay the log into a fresh one, which
+    // only becomes valid once the replay is complete
+    table_generation = 0;
+    active_table = 0;
+    has_table = table_flash.erase(tableAddress(0), table_size);
+    uncommitted = has_table;
+    return has_table;
+  }
+
+  for (uint32_t i = 0; i < slot_count; i++) {
+    if (*slotAddress(active_table, i) != EMPTY_SLOT) {
+      slots_used++;
+    }
+  }
+  return false;
+}
+
+uint32_t FlashKVLargeClass::indexCount()
+{
+  uint32_t count = 0;
+  uint8_t type;
+  for (uint32_t i = 0; has_table && i < slot_count; i++) {
+    if (isNewest(i, &type) && type == RECORD_VALUE) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Every put, removal and copy takes a slot, new key or not
+bool FlashKVLargeClass::indexHasRoom(uint32_t new_keys, uint32_t updates)
+{
+  (void)new_keys;  // Counted in updates
+  // Locations must fit the 16-bit half of a slot
+  if (!has_table || unit_count * unit_size > 0xFFFFUL * FLASHSTORAGE_WRITE_GRANULE) {
+    return false;
+  }
+  if (slots_used + updates <= slot_count * 3 / 4) {
+    return true;
+  }
+  return rebuild() && slots_used + updates <= slot_count * 3 / 4;
+}
+
+void FlashKVLargeClass::indexReplayed()
+{
+  if (uncommitted) {
+    uncommitted = false;
+    if (!commitTable(active_table, table_generation)) {
+      has_table = false;
+    }
+  }
+}
+
+uint32_t FlashKVLargeClass::indexFind(const char *key, uint8_t key_len, uint16_t hash)
+{
+  if (!has_table) {
+    return NO_RECORD;
+  }
+
+  uint32_t i = findSlot(active_table, key, key_len, hash);
+  if (i == slot_count) {
+    return NO_RECORD;
+  }
+
+  RecordHeader header;
+  uint32_t location = slotLocation(*slotAddress(active_table, i));
+  return (readRecordAt(location, &header) && header.type == RECORD_VALUE) ? location : NO_RECORD;
+}
+
+bool FlashKVLargeClass::indexSet(const char *key, uint8_t key_len, uint16_t hash, uint32_t location)
+{
+  (void)key;  // Keys are checked against the record on lookup
+  (void)key_len;
+  return addSlot(hash, location);
+}
+
+// The slot points at the removal record, which hides older values
+bool FlashKVLargeClass::indexRemove(const char *key, uint8_t key_len, uint16_t hash, uint32_t location)
+{
+  (void)key;
+  (void)key_len;
+  return addSlot(hash, location);
+}
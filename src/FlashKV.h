@@ -0,0 +1,276 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef FLASHKV_H
+#define FLASHKV_H
+
+#pragma once
+
+#include "SAMD_SafeFlashStorage.h"
+
+// Longest key accepted by put()/get()/remove(), not counting the terminator
+#ifndef FLASHKV_MAX_KEY_LENGTH
+  #define FLASHKV_MAX_KEY_LENGTH 32
+#endif
+
+#if defined(__SAMD51__)
+  #define FLASHKV_UNIT_SIZE 8192
+
+// Key-value store over 'units' 8KB blocks (at least 2) holding up to max_keys keys
+#define FlashKV(name, units, max_keys) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  static FlashKVIndexEntry FLASHSTORAGE_PPCAT(_index,name)[(max_keys)+(max_keys)/4+1]; \
+  FlashKVClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units, \
+                    FLASHSTORAGE_PPCAT(_index,name), (max_keys)+(max_keys)/4+1);
+
+// Same, with the index kept in two flash tables instead of RAM
+#define FlashKVLarge(name, units, max_keys) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_table,name)[2*FLASHKV_TABLE_BYTES(max_keys, 8192)] = { }; \
+  FlashKVLargeClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units, \
+                         FLASHSTORAGE_PPCAT(_table,name), FLASHKV_TABLE_BYTES(max_keys, 8192));
+#else
+  // Four 256-byte rows, so records of a few hundred bytes still fit in a unit
+  #define FLASHKV_UNIT_SIZE 1024
+
+// Key-value store over 'units' 1KB units (at least 2) holding up to max_keys keys
+#define FlashKV(name, units, max_keys) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  static FlashKVIndexEntry FLASHSTORAGE_PPCAT(_index,name)[(max_keys)+(max_keys)/4+1]; \
+  FlashKVClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units, \
+                    FLASHSTORAGE_PPCAT(_index,name), (max_keys)+(max_keys)/4+1);
+
+// Same, with the index kept in two flash tables instead of RAM
+#define FlashKVLarge(name, units, max_keys) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_table,name)[2*FLASHKV_TABLE_BYTES(max_keys, 256)] = { }; \
+  FlashKVLargeClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units, \
+                         FLASHSTORAGE_PPCAT(_table,name), FLASHKV_TABLE_BYTES(max_keys, 256));
+#endif
+
+// Size of one FlashKVLarge index table: three slots per key, each a program
+// granule, plus the header, rounded up to the erase unit
+#define FLASHKV_TABLE_BYTES(max_keys, erase_size) \
+  (((max_keys) * 3 * FLASHSTORAGE_WRITE_GRANULE + 16 + (erase_size) - 1) / (erase_size) * (erase_size))
+
+// RAM index slot: where the newest record for a key lives
+struct FlashKVIndexEntry {
+  uint32_t location;  // Byte offset of the record in the region
+  uint16_t hash;      // Key hash, checked before comparing keys in flash
+};
+
+// Many named values in one flash region. Records are appended to a log that
+// spans several erase units, and a small open-addressed hash table in RAM maps
+// each key to its newest record, so lookups never scan flash. When the log is
+// full, the live records of the oldest unit are copied forward and the unit is
+// erased. One unit is always kept free for this, so a reset at any point
+// leaves either the old or the new copy of every record readable.
+//
+// WARNING: Not interrupt-safe or thread-safe, same as FlashClass.
+class FlashKVClass {
+public:
+  FlashKVClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units,
+               FlashKVIndexEntry *index_table, uint32_t index_slots);
+
+  // Store size bytes under key. Returns true on success, false if the key is
+  // invalid, the index or the region is full, or on a flash error.
+  // Optimization: Skips the write if the stored value is unchanged.
+  bool put(const char *key, const void *value, uint16_t size);
+
+  // Copy the value stored under key. Returns false if the key is missing or
+  // its stored size differs from size.
+  bool get(const char *key, void *value, uint16_t size);
+
+  // Delete key. Returns false only on error; removing a missing key succeeds.
+  bool remove(const char *key);
+
+  bool contains(const char *key);
+
+  // Size of the value stored under key, 0 if the key is missing
+  uint16_t valueSize(const char *key);
+
+  // Number of keys currently stored
+  uint32_t count();
+
+  template<class T> bool put(const char *key, const T &value) { return put(key, &value, sizeof(T)); }
+  template<class T> bool get(const char *key, T *value) { return get(key, value, sizeof(T)); }
+
+protected:
+  enum { RECORD_VALUE = 0x5A, RECORD_REMOVED = 0xA5 };
+  enum { RECORD_END, RECORD_VALID, RECORD_CORRUPT, RECORD_BROKEN };
+  static const uint32_t NO_RECORD = 0xFFFFFFFF;
+
+  struct UnitHeader {
+    uint16_t magic;
+    uint16_t checksum;    // Covers generation
+    uint32_t generation;  // Increases with every unit opened
+  };
+
+  struct RecordHeader {
+    uint16_t key_hash;
+    uint8_t key_len;
+    uint8_t type;         // RECORD_VALUE or RECORD_REMOVED
+    uint16_t value_len;
+    uint16_t checksum;    // Covers the fields above, key and value
+  };
+
+  // Records start on a program granule. The key follows the header and the
+  // value starts on the next word.
+  static const uint32_t UNIT_HEADER_SIZE =
+    (sizeof(UnitHeader) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+
+  static uint32_t valueOffset(uint8_t key_len) {
+    return sizeof(RecordHeader) + ((key_len + 3) & ~3U);
+  }
+  static uint32_t recordSize(uint8_t key_len, uint16_t value_len) {
+    return (valueOffset(key_len) + value_len + FLASHSTORAGE_WRITE_GRANULE - 1) /
+           FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+  static uint16_t recordChecksum(const RecordHeader &header, const uint8_t *key, const uint8_t *value);
+  static uint16_t keyHash(const char *key, uint8_t key_len);
+
+  const volatile uint8_t *unitAddress(uint32_t unit) const { return base + unit * unit_size; }
+
+  // True if a valid, checksummed record starts at location
+  bool readRecordAt(uint32_t location, RecordHeader *header);
+  bool keyMatches(uint32_t location, const char *key, uint8_t key_len);
+
+  // Index hooks. The default keeps the index in RAM and rebuilds it from
+  // the log on mount. Locations are byte offsets into the log region.
+  // indexReset() runs at mount and returns true if the log must be replayed
+  // through indexSet()/indexRemove(), after which indexReplayed() is called.
+  // indexHasRoom() checks that new_keys more keys and updates more calls to
+  // indexSet()/indexRemove() will fit. indexFind() returns the location of
+  // the newest value for a key, or NO_RECORD if it is missing or removed.
+  virtual bool indexReset();
+  virtual void indexReplayed();
+  virtual uint32_t indexCount();
+  virtual bool indexHasRoom(uint32_t new_keys, uint32_t updates);
+  virtual uint32_t indexFind(const char *key, uint8_t key_len, uint16_t hash);
+  virtual bool indexSet(const char *key, uint8_t key_len, uint16_t hash, uint32_t location);
+  virtual bool indexRemove(const char *key, uint8_t key_len, uint16_t hash, uint32_t location);
+
+  FlashClass flash;
+  const volatile uint8_t *base;
+  const uint32_t unit_size, unit_count;
+
+private:
+  bool prepare(const char *key, uint8_t *key_len);
+  void mount();
+  uint32_t replayUnit(uint32_t unit, bool apply);
+  bool readUnit(uint32_t unit, uint32_t *generation);
+  uint8_t readRecord(uint32_t unit, uint32_t offset, RecordHeader *header);
+
+  // Log space management
+  uint32_t freeUnit();
+  uint32_t countFree();
+  bool openFreeUnit();
+  bool ensureRoom(uint32_t size);
+  bool isLive(uint32_t location, const RecordHeader &header);
+  bool reclaim();
+  bool append(uint8_t type, const char *key, uint8_t key_len, uint16_t hash,
+              const void *value, uint16_t value_len, uint32_t *location);
+
+  // RAM index (linear probing, backward-shift deletion)
+  uint32_t ramFind(const char *key, uint8_t key_len, uint16_t hash, uint32_t *slot);
+
+  FlashKVIndexEntry *index;
+  const uint32_t index_slots;
+  uint32_t index_count;
+
+  // Log head, found by mount() and kept up to date by append()
+  bool mounted;
+  bool has_active;
+  uint32_t active_unit;
+  uint32_t write_offset;
+  uint32_t next_generation;
+};
+
+// FlashKV for key sets too large for a RAM index. The index is an open-
+// addressed hash table in flash whose slots map a key hash to a record
+// location. Slots are write-once: every put() or remove() programs the next
+// empty slot of the key's probe run, and the last slot whose record holds the
+// key wins. Lookups are a short run of memory-mapped reads. Once the table is
+// three-quarters full, the newest slot of every live key is copied into the
+// second table area, which then takes over. RAM use is a few words.
+class FlashKVLargeClass : public FlashKVClass {
+public:
+  // table_bytes is the size of each of the two table areas at table_addr
+  FlashKVLargeClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units,
+                    const void *table_addr, uint32_t table_bytes);
+
+protected:
+  bool indexReset();
+  void indexReplayed();
+  uint32_t indexCount();
+  bool indexHasRoom(uint32_t new_keys, uint32_t updates);
+  uint32_t indexFind(const char *key, uint8_t key_len, uint16_t hash);
+  bool indexSet(const char *key, uint8_t key_len, uint16_t hash, uint32_t location);
+  bool indexRemove(const char *key, uint8_t key_len, uint16_t hash, uint32_t location);
+
+private:
+  static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+  struct TableHeader {
+    uint16_t magic;
+    uint16_t checksum;    // Covers generation
+    uint32_t generation;  // Increases with every rebuild
+  };
+
+  static const uint32_t TABLE_HEADER_SIZE =
+    (sizeof(TableHeader) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+
+  // A slot holds the key hash in its upper half and the record location, in
+  // program granules, in its lower half. Each slot has a program granule to
+  // itself, so filling one never reprograms a neighbour's SAMD51 quad-word.
+  static const uint32_t SLOT_SIZE = FLASHSTORAGE_WRITE_GRANULE;
+  static uint32_t slotLocation(uint32_t slot) { return (slot & 0xFFFF) * FLASHSTORAGE_WRITE_GRANULE; }
+
+  const volatile uint8_t *tableAddress(uint32_t table) const { return tables + table * table_size; }
+  const volatile uint32_t *slotAddress(uint32_t table, uint32_t i) const {
+    return (const volatile uint32_t *)(tableAddress(table) + TABLE_HEADER_SIZE + i * SLOT_SIZE);
+  }
+
+  bool readTable(uint32_t table, uint32_t *generation);
+  bool commitTable(uint32_t table, uint32_t generation);
+  uint32_t findSlot(uint32_t table, const char *key, uint8_t key_len, uint16_t hash);
+  bool isNewest(uint32_t slot, uint8_t *type);
+  bool insertSlot(uint32_t table, uint32_t slot);
+  bool addSlot(uint16_t hash, uint32_t location);
+  bool rebuild();
+
+  FlashClass table_flash;
+  const volatile uint8_t *tables;
+  const uint32_t table_size, slot_count;
+
+  // Active table, found by indexReset()
+  bool has_table;
+  bool uncommitted;  // Being rebuilt from the log, header not written yet
+  uint32_t active_table;
+  uint32_t table_generation;
+  uint32_t slots_used;
+};
+
+#endif // FLASHKV_H
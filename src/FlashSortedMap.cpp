@@ -0,0 +1,890 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "FlashSortedMap.h"
+#include <stddef.h>
+
+static const uint16_t MEMTABLE_MAGIC = 0x534D;  // "MS"
+static const uint16_t RUN_MAGIC = 0x5352;       // "RS"
+
+// Offsets written to a segment's offset table at a time
+static const uint16_t OFFSET_CHUNK = 16;
+
+// Bloom filter bits set per key
+static const uint8_t BLOOM_HASHES = 4;
+
+// Same hash as FlashKV, so records have the same layout in both
+static uint16_t keyHash(const char *key, uint8_t key_len)
+{
+  uint16_t hash = 0x5A5A;
+  for (uint8_t i = 0; i < key_len; i++) {
+    hash = FlashStorageInternal::hash_combine(hash, (uint16_t)key[i]);
+  }
+  return hash;
+}
+
+FlashSortedMapClass::FlashSortedMapClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units) :
+  flash(flash_addr, unit_bytes * units),
+  base((const volatile uint8_t *)flash_addr),
+  unit_size(unit_bytes),
+  unit_count(units),
+  mounted(false),
+  has_mem(false),
+  mem_unit(0),
+  write_offset(0),
+  next_generation(0),
+  run_count(0)
+{
+}
+
+uint16_t FlashSortedMapClass::headerChecksum(const UnitHeader &header)
+{
+  return FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation,
+                                            sizeof(UnitHeader) - offsetof(UnitHeader, generation));
+}
+
+uint16_t FlashSortedMapClass::recordChecksum(const RecordHeader &header, const uint8_t *key, const uint8_t *value)
+{
+  using namespace FlashStorageInternal;
+  uint16_t sum = calcChecksum((const uint8_t *)&header, offsetof(RecordHeader, checksum));
+  sum = hash_combine(sum, calcChecksum(key, header.key_len));
+  return hash_combine(sum, calcChecksum(value, header.value_len));
+}
+
+// FNV-1a, independent of the 16-bit record hash
+uint32_t FlashSortedMapClass::bloomHash(const volatile uint8_t *key, uint8_t key_len)
+{
+  uint32_t hash = 2166136261UL;
+  for (uint8_t i = 0; i < key_len; i++) {
+    hash = (hash ^ key[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+// Double hashing: bit i is h1 + i * h2, with h2 odd
+void FlashSortedMapClass::bloomAdd(uint8_t *bloom, uint32_t hash)
+{
+  uint16_t h1 = (uint16_t)hash, h2 = (uint16_t)(hash >> 16) | 1;
+  for (uint8_t i = 0; i < BLOOM_HASHES; i++) {
+    uint16_t bit = (uint16_t)(h1 + i * h2) % (FLASHSORTEDMAP_BLOOM_BYTES * 8);
+    bloom[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+bool FlashSortedMapClass::bloomMayContain(uint32_t unit, uint32_t hash) const
+{
+  const volatile uint8_t *bloom = unitAddress(unit) + UNIT_HEADER_SIZE;
+  uint16_t h1 = (uint16_t)hash, h2 = (uint16_t)(hash >> 16) | 1;
+  for (uint8_t i = 0; i < BLOOM_HASHES; i++) {
+    uint16_t bit = (uint16_t)(h1 + i * h2) % (FLASHSORTEDMAP_BLOOM_BYTES * 8);
+    if (!(bloom[bit / 8] & (1 << (bit % 8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Byte order, shorter key first on a tie, so "cal" < "cal/" < "cal/a"
+int FlashSortedMapClass::compareKeys(const volatile uint8_t *a, uint8_t a_len, const char *b, uint8_t b_len)
+{
+  int result = memcmp((const void *)a, b, a_len < b_len ? a_len : b_len);
+  return result != 0 ? result : (int)a_len - (int)b_len;
+}
+
+bool FlashSortedMapClass::prepare(const char *key, uint8_t *key_len)
+{
+  if (key == NULL || unit_count < 3) {
+    return false;
+  }
+
+  size_t len = strlen(key);
+  if (len == 0 || len > FLASHKV_MAX_KEY_LENGTH) {
+    return false;
+  }
+  *key_len = (uint8_t)len;
+
+  if (!mounted) {
+    mount();
+  }
+  return true;
+}
+
+bool FlashSortedMapClass::readUnit(uint32_t unit, UnitHeader *header)
+{
+  return flash.read(unitAddress(unit), header, sizeof(UnitHeader)) &&
+         (header->magic == MEMTABLE_MAGIC || header->magic == RUN_MAGIC) &&
+         header->checksum == headerChecksum(*header);
+}
+
+uint8_t FlashSortedMapClass::readRecord(uint32_t unit, uint32_t offset, RecordHeader *header)
+{
+  if (offset + sizeof(RecordHeader) > unit_size) {
+    return RECORD_END;
+  }
+
+  const volatile uint8_t *record = unitAddress(unit) + offset;
+  if (flash.isErased(record, sizeof(RecordHeader))) {
+    // Blank header ends the memtable, unless a reset left a record body behind it
+    return flash.isErased(record, unit_size - offset) ? RECORD_END : RECORD_BROKEN;
+  }
+
+  flash.read(record, header, sizeof(RecordHeader));
+  if ((header->type != RECORD_VALUE && header->type != RECORD_REMOVED) ||
+      header->key_len == 0 || header->key_len > FLASHKV_MAX_KEY_LENGTH ||
+      offset + recordSize(header->key_len, header->value_len) > unit_size) {
+    return RECORD_BROKEN;
+  }
+
+  if (header->checksum != recordChecksum(*header, (const uint8_t *)(record + sizeof(RecordHeader)),
+                                         (const uint8_t *)(record + valueOffset(header->key_len)))) {
+    return RECORD_CORRUPT;
+  }
+  return RECORD_VALID;
+}
+
+uint32_t FlashSortedMapClass::segmentUnit(uint32_t generation, uint8_t index)
+{
+  UnitHeader header;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (readUnit(unit, &header) && header.magic == RUN_MAGIC &&
+        header.generation == generation && header.index == index) {
+      return unit;
+    }
+  }
+  return unit_count;
+}
+
+// Collect complete runs, erase the units a finished merge replaced and the
+// segments of an unfinished one, then find the end of the memtable
+void FlashSortedMapClass::mount()
+{
+  UnitHeader header;
+  run_count = 0;
+  has_mem = false;
+  next_generation = 0;
+
+  // A run is complete once its last segment, which is written last, is in
+  // flash along with all segments before it
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &header)) {
+      continue;
+    }
+    if (header.generation >= next_generation) {
+      next_generation = header.generation + 1;
+    }
+    if (header.magic != RUN_MAGIC || !header.last || run_count > FLASHSORTEDMAP_MAX_RUNS) {
+      continue;
+    }
+
+    bool complete = true;
+    for (uint8_t index = 0; index < header.index && complete; index++) {
+      complete = segmentUnit(header.generation, index) != unit_count;
+    }
+    if (complete) {
+      runs[run_count].generation = header.generation;
+      runs[run_count].lo = header.lo;
+      runs[run_count].segments = header.index + 1;
+      run_count++;
+    }
+  }
+
+  // Drop runs that a reset caught between a merge and erasing its inputs
+  uint8_t kept = 0;
+  for (uint8_t run = 0; run < run_count; run++) {
+    bool merged = false;
+    for (uint8_t other = 0; other < run_count; other++) {
+      merged |= runs[run].generation >= runs[other].lo && runs[run].generation < runs[other].generation;
+    }
+    if (!merged) {
+      runs[kept++] = runs[run];
+    }
+  }
+  run_count = kept;
+
+  // Oldest first, so newer runs are looked at last and win merges
+  for (uint8_t i = 1; i < run_count; i++) {
+    Run run = runs[i];
+    uint8_t j = i;
+    for (; j > 0 && runs[j - 1].generation > run.generation; j--) {
+      runs[j] = runs[j - 1];
+    }
+    runs[j] = run;
+  }
+
+  uint32_t mem_generation = 0;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &header)) {
+      continue;
+    }
+
+    bool keep = header.magic == MEMTABLE_MAGIC;
+    for (uint8_t run = 0; run < run_count; run++) {
+      if (header.magic == RUN_MAGIC && header.generation == runs[run].generation) {
+        keep = true;
+      }
+    }
+    for (uint8_t run = 0; run < run_count; run++) {
+      if (header.generation >= runs[run].lo && header.generation < runs[run].generation) {
+        keep = false;  // Already merged into this run
+      }
+    }
+
+    if (!keep) {
+      flash.erase(unitAddress(unit), unit_size);
+    } else if (header.magic == MEMTABLE_MAGIC && (!has_mem || header.generation > mem_generation)) {
+      has_mem = true;
+      mem_unit = unit;
+      mem_generation = header.generation;
+    }
+  }
+
+  if (has_mem) {
+    RecordHeader record;
+    uint32_t offset = UNIT_HEADER_SIZE;
+    uint8_t status;
+    while ((status = readRecord(mem_unit, offset, &record)) == RECORD_VALID || status == RECORD_CORRUPT) {
+      offset += recordSize(record.key_len, record.value_len);
+    }
+    write_offset = (status == RECORD_END) ? offset : unit_size;  // A broken record fills the memtable
+  }
+  mounted = true;
+}
+
+// Newest record for key, value or removal marker, or NO_RECORD
+uint32_t FlashSortedMapClass::find(const char *key, uint8_t key_len)
+{
+  if (has_mem) {
+    uint16_t hash = keyHash(key, key_len);
+    uint32_t found = NO_RECORD, offset = UNIT_HEADER_SIZE;
+    RecordHeader header;
+    uint8_t status;
+    while ((status = readRecord(mem_unit, offset, &header)) == RECORD_VALID || status == RECORD_CORRUPT) {
+      uint32_t location = mem_unit * unit_size + offset;
+      if (status == RECORD_VALID && header.key_hash == hash &&
+          compareKeys(keyAt(location), header.key_len, key, key_len) == 0) {
+        found = location;  // Later records are newer
+      }
+      offset += recordSize(header.key_len, header.value_len);
+    }
+    if (found != NO_RECORD) {
+      return found;
+    }
+  }
+
+  uint32_t hash = bloomHash((const volatile uint8_t *)key, key_len);
+  for (uint8_t run = run_count; run-- > 0; ) {
+    uint32_t location = findInRun(run, key, key_len, hash);
+    if (location != NO_RECORD) {
+      return location;
+    }
+  }
+  return NO_RECORD;
+}
+
+// Segments of a run don't overlap, so they can be visited in any order.
+// The Bloom filter rules out most segments without reading their keys.
+uint32_t FlashSortedMapClass::findInRun(uint8_t run, const char *key, uint8_t key_len, uint32_t hash)
+{
+  UnitHeader header;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &header) || header.magic != RUN_MAGIC || header.generation != runs[run].generation ||
+        header.entries == 0 || !bloomMayContain(unit, hash)) {
+      continue;
+    }
+
+    uint16_t lo = 0, hi = header.entries - 1;
+    uint32_t first = entryLocation(unit, lo), last = entryLocation(unit, hi);
+    if (compareKeys(keyAt(first), recordAt(first)->key_len, key, key_len) > 0 ||
+        compareKeys(keyAt(last), recordAt(last)->key_len, key, key_len) < 0) {
+      continue;  // False positive
+    }
+
+    while (lo <= hi) {
+      uint16_t mid = lo + (hi - lo) / 2;
+      uint32_t location = entryLocation(unit, mid);
+      int order = compareKeys(keyAt(location), recordAt(location)->key_len, key, key_len);
+      if (order == 0) {
+        return location;
+      }
+      if (order < 0) {
+        lo = mid + 1;
+      } else if (mid == 0) {
+        break;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return NO_RECORD;  // Only this segment could hold the key
+  }
+  return NO_RECORD;
+}
+
+// Point cursor at the first entry of a run whose key is not below key
+void FlashSortedMapClass::seekRun(uint8_t run, const char *key, uint8_t key_len, FlashSortedMapIterator::RunCursor *cursor)
+{
+  cursor->done = true;
+  for (uint8_t segment = 0; segment < runs[run].segments; segment++) {
+    uint32_t unit = segmentUnit(runs[run].generation, segment);
+    if (unit == unit_count) {
+      return;
+    }
+
+    // Segments don't overlap, so skip those ending below key
+    uint16_t entries = segmentEntries(unit);
+    if (entries == 0) {
+      continue;
+    }
+    uint32_t last = entryLocation(unit, entries - 1);
+    if (compareKeys(keyAt(last), recordAt(last)->key_len, key, key_len) < 0) {
+      continue;
+    }
+
+    uint16_t lo = 0, hi = entries - 1;
+    while (lo < hi) {
+      uint16_t mid = lo + (hi - lo) / 2;
+      uint32_t location = entryLocation(unit, mid);
+      if (compareKeys(keyAt(location), recordAt(location)->key_len, key, key_len) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    cursor->unit = unit;
+    cursor->segment = segment;
+    cursor->index = lo;
+    cursor->done = false;
+    return;
+  }
+}
+
+void FlashSortedMapClass::advanceRun(uint8_t run, FlashSortedMapIterator::RunCursor *cursor)
+{
+  if (++cursor->index < segmentEntries(cursor->unit)) {
+    return;
+  }
+  if (cursor->segment + 1 < runs[run].segments) {
+    uint32_t unit = segmentUnit(runs[run].generation, cursor->segment + 1);
+    if (unit != unit_count) {
+      cursor->unit = unit;
+      cursor->segment++;
+      cursor->index = 0;
+      return;
+    }
+  }
+  cursor->done = true;
+}
+
+void FlashSortedMapClass::startMerge(FlashSortedMapIterator *it, uint8_t first_run, bool keep_removed,
+                                     const char *lower, uint8_t lower_len)
+{
+  it->map = this;
+  it->location = NO_RECORD;
+  it->first_run = first_run;
+  it->keep_removed = keep_removed;
+  it->inclusive = true;
+  it->ended = false;
+  it->last_len = lower_len;
+  memcpy(it->last_key, lower, lower_len);
+  it->last_key[lower_len] = '\0';
+  it->bound = FlashSortedMapIterator::BOUND_NONE;
+  it->bound_len = 0;
+  it->bound_key[0] = '\0';
+
+  for (uint8_t run = first_run; run < run_count; run++) {
+    seekRun(run, lower, lower_len, &it->cursors[run]);
+  }
+}
+
+// K-way merge step. Every run cursor sits on its first key after the last
+// one returned, and the unsorted memtable is scanned for its smallest key
+// after it. Sources are visited oldest first, so on equal keys the newest
+// record wins.
+bool FlashSortedMapClass::mergeNext(FlashSortedMapIterator *it)
+{
+  while (!it->ended) {
+    uint32_t best = NO_RECORD;
+    for (uint8_t run = it->first_run; run < run_count; run++) {
+      if (!it->cursors[run].done) {
+        uint32_t location = entryLocation(it->cursors[run].unit, it->cursors[run].index);
+        if (best == NO_RECORD ||
+            compareKeys(keyAt(location), recordAt(location)->key_len, (const char *)keyAt(best), recordAt(best)->key_len) <= 0) {
+          best = location;
+        }
+      }
+    }
+
+    if (has_mem) {
+      uint32_t offset = UNIT_HEADER_SIZE;
+      RecordHeader header;
+      uint8_t status;
+      while ((status = readRecord(mem_unit, offset, &header)) == RECORD_VALID || status == RECORD_CORRUPT) {
+        uint32_t location = mem_unit * unit_size + offset;
+        if (status == RECORD_VALID) {
+          int after = compareKeys(keyAt(location), header.key_len, it->last_key, it->last_len);
+          if ((after > 0 || (after == 0 && it->inclusive)) &&
+              (best == NO_RECORD ||
+               compareKeys(keyAt(location), header.key_len, (const char *)keyAt(best), recordAt(best)->key_len) <= 0)) {
+            best = location;
+          }
+        }
+        offset += recordSize(header.key_len, header.value_len);
+      }
+    }
+
+    if (best == NO_RECORD) {
+      it->ended = true;
+      break;
+    }
+
+    const char *key = (const char *)keyAt(best);
+    uint8_t key_len = recordAt(best)->key_len;
+    if ((it->bound == FlashSortedMapIterator::BOUND_PREFIX &&
+         (key_len < it->bound_len || memcmp(key, it->bound_key, it->bound_len) != 0)) ||
+        (it->bound == FlashSortedMapIterator::BOUND_BELOW &&
+         compareKeys(keyAt(best), key_len, it->bound_key, it->bound_len) >= 0)) {
+      it->ended = true;  // Keys only grow from here
+      break;
+    }
+
+    for (uint8_t run = it->first_run; run < run_count; run++) {
+      FlashSortedMapIterator::RunCursor *cursor = &it->cursors[run];
+      if (!cursor->done) {
+        uint32_t location = entryLocation(cursor->unit, cursor->index);
+        if (compareKeys(keyAt(location), recordAt(location)->key_len, key, key_len) == 0) {
+          advanceRun(run, cursor);
+        }
+      }
+    }
+
+    memcpy(it->last_key, key, key_len);
+    it->last_key[key_len] = '\0';
+    it->last_len = key_len;
+    it->inclusive = false;
+    it->location = best;
+    if (recordAt(best)->type == RECORD_VALUE || it->keep_removed) {
+      return true;
+    }
+  }
+
+  it->location = NO_RECORD;
+  return false;
+}
+
+// Take as many merged records as fit in one segment. Sets more if records
+// are left for the next segment.
+uint16_t FlashSortedMapClass::packSegment(FlashSortedMapIterator *it, bool *more)
+{
+  uint32_t used = 0;
+  uint16_t entries = 0;
+  while (true) {
+    FlashSortedMapIterator saved = *it;
+    if (!mergeNext(it)) {
+      *more = false;
+      return entries;
+    }
+
+    uint32_t size = recordSize(recordAt(it->location)->key_len, recordAt(it->location)->value_len);
+    if (entries == 0xFFFF || recordsOffset(entries + 1) + used + size > unit_size) {
+      *it = saved;
+      *more = true;
+      return entries;
+    }
+    used += size;
+    entries++;
+  }
+}
+
+// Merge the memtable and runs first_run and newer into one new run, then
+// erase them. Removal markers are only kept while older runs remain.
+bool FlashSortedMapClass::mergeRuns(uint8_t first_run)
+{
+  if (!has_mem && first_run >= run_count) {
+    return true;  // Nothing to merge
+  }
+
+  FlashSortedMapIterator it;
+  startMerge(&it, first_run, first_run > 0, "", 0);
+
+  // Size the new run before touching flash
+  FlashSortedMapIterator plan = it;
+  uint32_t segments = 0, entries = 0;
+  bool more = true;
+  while (more) {
+    uint16_t packed = packSegment(&plan, &more);
+    if (packed == 0 && more) {
+      return false;  // Record too large for a segment
+    }
+    entries += packed;
+    segments++;
+  }
+  if (entries == 0) {
+    segments = 0;  // Everything was removed, no run needed
+  }
+  if (segments > countFree() || segments > 0xFF) {
+    return false;
+  }
+
+  UnitHeader header;
+  header.magic = RUN_MAGIC;
+  header.generation = next_generation;
+  header.lo = (first_run < run_count) ? runs[first_run].lo :
+              ((const volatile UnitHeader *)unitAddress(mem_unit))->generation;
+
+  for (uint32_t segment = 0; segment < segments; segment++) {
+    FlashSortedMapIterator start = it;
+    header.entries = packSegment(&it, &more);
+    header.index = (uint8_t)segment;
+    header.last = more ? 0 : 1;
+    header.checksum = headerChecksum(header);
+
+    uint32_t unit = freeUnit();
+    if (unit == unit_count || !flash.erase(unitAddress(unit), unit_size)) {
+      mounted = false;
+      return false;
+    }
+
+    // Records, offsets and Bloom filter first, header last
+    const volatile uint8_t *dst = unitAddress(unit);
+    uint8_t bloom[FLASHSORTEDMAP_BLOOM_BYTES];
+    memset(bloom, 0, sizeof(bloom));
+    uint16_t offsets[OFFSET_CHUNK];
+    uint32_t offset = recordsOffset(header.entries);
+    for (uint16_t i = 0; i < header.entries; i++) {
+      mergeNext(&start);
+      const volatile RecordHeader *record = recordAt(start.location);
+      uint32_t size = recordSize(record->key_len, record->value_len);
+      if (!flash.write(dst + offset, (const void *)record, size)) {
+        mounted = false;
+        return false;
+      }
+      bloomAdd(bloom, bloomHash(dst + offset + sizeof(RecordHeader), record->key_len));
+
+      offsets[i % OFFSET_CHUNK] = (uint16_t)offset;
+      if (i % OFFSET_CHUNK == OFFSET_CHUNK - 1 || i + 1 == header.entries) {
+        uint16_t first = i - i % OFFSET_CHUNK;
+        if (!flash.write(dst + OFFSETS_OFFSET + first * sizeof(uint16_t), offsets,
+                         (i - first + 1) * sizeof(uint16_t))) {
+          mounted = false;
+          return false;
+        }
+      }
+      offset += size;
+    }
+
+    if (!flash.write(dst + UNIT_HEADER_SIZE, bloom, sizeof(bloom)) ||
+        !flash.write(dst, &header, sizeof(UnitHeader))) {
+      mounted = false;
+      return false;
+    }
+  }
+  if (segments > 0) {
+    next_generation++;
+  }
+
+  // Erase the merged units oldest first. With no new run to replace them,
+  // an interruption then still leaves every remaining record shadowed by
+  // the newer ones.
+  while (true) {
+    uint32_t oldest = unit_count, oldest_generation = 0;
+    for (uint32_t unit = 0; unit < unit_count; unit++) {
+      UnitHeader merged;
+      if (readUnit(unit, &merged) && merged.generation >= header.lo && merged.generation < header.generation &&
+          (oldest == unit_count || merged.generation < oldest_generation)) {
+        oldest = unit;
+        oldest_generation = merged.generation;
+      }
+    }
+    if (oldest == unit_count) {
+      break;
+    }
+    if (!flash.erase(unitAddress(oldest), unit_size)) {
+      mounted = false;
+      return false;
+    }
+  }
+
+  mount();
+  return true;
+}
+
+// Turn the full memtable into a new run. Once the run limit is reached, or
+// free units run short of what merging all runs would take, merge
+// everything into one instead, before stale copies use up that room.
+bool FlashSortedMapClass::flush()
+{
+  uint32_t run_units = 0;
+  for (uint8_t run = 0; run < run_count; run++) {
+    run_units += runs[run].segments;
+  }
+  if (run_count < FLASHSORTEDMAP_MAX_RUNS && countFree() >= run_units + 2 && mergeRuns(run_count)) {
+    return true;
+  }
+  return mounted && mergeRuns(0);
+}
+
+uint32_t FlashSortedMapClass::freeUnit()
+{
+  UnitHeader header;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &header)) {
+      return unit;
+    }
+  }
+  return unit_count;
+}
+
+uint32_t FlashSortedMapClass::countFree()
+{
+  UnitHeader header;
+  uint32_t count = 0;
+  for (uint32_t unit = 0; unit < unit_count; unit++) {
+    if (!readUnit(unit, &header)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+bool FlashSortedMapClass::openMemtable()
+{
+  // Leave a unit free besides the memtable, so it can be flushed later
+  if (countFree() < 2 && run_count > 1) {
+    mergeRuns(0);
+  }
+  if (!mounted || countFree() < 2) {
+    return false;
+  }
+
+  UnitHeader header;
+  header.magic = MEMTABLE_MAGIC;
+  header.generation = next_generation;
+  header.lo = next_generation;
+  header.entries = 0;
+  header.index = 0;
+  header.last = 1;
+  header.checksum = headerChecksum(header);
+
+  uint32_t unit = freeUnit();
+  if (!flash.erase(unitAddress(unit), unit_size) || !flash.write(unitAddress(unit), &header, sizeof(UnitHeader))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+
+  next_generation++;
+  has_mem = true;
+  mem_unit = unit;
+  write_offset = UNIT_HEADER_SIZE;
+  return true;
+}
+
+bool FlashSortedMapClass::append(uint8_t type, const char *key, uint8_t key_len, const void *value, uint16_t value_len)
+{
+  // Every record has to fit into a run segment on its own
+  uint32_t size = recordSize(key_len, value_len);
+  if (size > unit_size - recordsOffset(1)) {
+    return false;
+  }
+
+  if (has_mem && write_offset + size > unit_size && !flush()) {
+    return false;
+  }
+  if (!has_mem && !openMemtable()) {
+    return false;
+  }
+
+  RecordHeader header;
+  header.key_hash = keyHash(key, key_len);
+  header.key_len = key_len;
+  header.type = type;
+  header.value_len = value_len;
+  header.checksum = recordChecksum(header, (const uint8_t *)key, (const uint8_t *)value);
+
+  // The header goes last, so a record only shows up once it is complete.
+  // It shares its granule with the start of the key, which is programmed
+  // with it in one go.
+  const volatile uint8_t *record = unitAddress(mem_unit) + write_offset;
+  FlashPart parts[] = {
+    { 0, &header, sizeof(RecordHeader) },
+    { sizeof(RecordHeader), key, key_len },
+    { valueOffset(key_len), value, value_len },
+  };
+  if (!flash.writeParts(record, size, parts, 3, sizeof(RecordHeader))) {
+    mounted = false;
+    return false;
+  }
+  write_offset += size;
+  return true;
+}
+
+bool FlashSortedMapClass::put(const char *key, const void *value, uint16_t size)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint32_t location = find(key, key_len);
+  if (location != NO_RECORD && recordAt(location)->type == RECORD_VALUE && recordAt(location)->value_len == size &&
+      memcmp((const void *)(base + location + valueOffset(key_len)), value, size) == 0) {
+    return true;  // Value unchanged, skip write to preserve flash endurance
+  }
+  return append(RECORD_VALUE, key, key_len, value, size);
+}
+
+bool FlashSortedMapClass::get(const char *key, void *value, uint16_t size)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint32_t location = find(key, key_len);
+  if (location == NO_RECORD || recordAt(location)->type != RECORD_VALUE ||
+      recordAt(location)->value_len != size) {
+    return false;
+  }
+  return flash.read(base + location + valueOffset(key_len), value, size);
+}
+
+bool FlashSortedMapClass::remove(const char *key)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint32_t location = find(key, key_len);
+  if (location == NO_RECORD || recordAt(location)->type != RECORD_VALUE) {
+    return true;  // Nothing to remove
+  }
+  return append(RECORD_REMOVED, key, key_len, NULL, 0);
+}
+
+bool FlashSortedMapClass::contains(const char *key)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return false;
+  }
+
+  uint32_t location = find(key, key_len);
+  return location != NO_RECORD && recordAt(location)->type == RECORD_VALUE;
+}
+
+uint16_t FlashSortedMapClass::valueSize(const char *key)
+{
+  uint8_t key_len;
+  if (!prepare(key, &key_len)) {
+    return 0;
+  }
+
+  uint32_t location = find(key, key_len);
+  if (location == NO_RECORD || recordAt(location)->type != RECORD_VALUE) {
+    return 0;
+  }
+  return recordAt(location)->value_len;
+}
+
+uint32_t FlashSortedMapClass::count()
+{
+  uint32_t count = 0;
+  FlashSortedMapIterator it = scan();
+  while (it.next()) {
+    count++;
+  }
+  return count;
+}
+
+FlashSortedMapIterator FlashSortedMapClass::scan(const char *prefix)
+{
+  FlashSortedMapIterator it;
+  size_t len = prefix ? strlen(prefix) : 0;
+  if (unit_count < 3 || len > FLASHKV_MAX_KEY_LENGTH) {
+    startMerge(&it, run_count, false, "", 0);
+    it.ended = true;
+    return it;
+  }
+
+  if (!mounted) {
+    mount();
+  }
+  startMerge(&it, 0, false, prefix ? prefix : "", (uint8_t)len);
+  it.bound = FlashSortedMapIterator::BOUND_PREFIX;
+  it.bound_len = (uint8_t)len;
+  memcpy(it.bound_key, it.last_key, len + 1);
+  return it;
+}
+
+FlashSortedMapIterator FlashSortedMapClass::range(const char *from, const char *to)
+{
+  FlashSortedMapIterator it;
+  size_t from_len = from ? strlen(from) : 0;
+  size_t to_len = to ? strlen(to) : 0;
+  if (unit_count < 3 || from_len > FLASHKV_MAX_KEY_LENGTH || to_len > FLASHKV_MAX_KEY_LENGTH) {
+    startMerge(&it, run_count, false, "", 0);
+    it.ended = true;
+    return it;
+  }
+
+  if (!mounted) {
+    mount();
+  }
+  startMerge(&it, 0, false, from ? from : "", (uint8_t)from_len);
+  if (to != NULL) {
+    it.bound = FlashSortedMapIterator::BOUND_BELOW;
+    it.bound_len = (uint8_t)to_len;
+    memcpy(it.bound_key, to, to_len + 1);
+  }
+  return it;
+}
+
+bool FlashSortedMapClass::compact()
+{
+  if (unit_count < 3) {
+    return false;
+  }
+  if (!mounted) {
+    mount();
+  }
+  if (!has_mem && run_count <= 1) {
+    return true;  // Already a single run without removal markers
+  }
+  return mergeRuns(0);
+}
+
+bool FlashSortedMapIterator::next()
+{
+  return map->mergeNext(this);
+}
+
+uint16_t FlashSortedMapIterator::valueSize() const
+{
+  if (location == FlashSortedMapClass::NO_RECORD) {
+    return 0;
+  }
+  return map->recordAt(location)->value_len;
+}
+
+bool FlashSortedMapIterator::value(void *value, uint16_t size) const
+{
+  if (location == FlashSortedMapClass::NO_RECORD || map->recordAt(location)->value_len != size) {
+    return false;
+  }
+  return map->flash.read(map->base + location + FlashSortedMapClass::valueOffset(last_len), value, size);
+}
@@ -0,0 +1,262 @@
+/*
+  Copyright (c) 2015 Arduino LLC.  All right reserved.
+  Written by Cristian Maglie, additional contributions by Xorlent
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+  See the GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef FLASHSORTEDMAP_H
+#define FLASHSORTEDMAP_H
+
+#pragma once
+
+#include "FlashKV.h"
+
+// Sorted runs kept before all of them are merged into one
+#ifndef FLASHSORTEDMAP_MAX_RUNS
+  #define FLASHSORTEDMAP_MAX_RUNS 4
+#endif
+
+#if defined(__SAMD51__)
+  // Bloom filter bits per run segment: 2048 for up to a few hundred keys
+  #ifndef FLASHSORTEDMAP_BLOOM_BYTES
+    #define FLASHSORTEDMAP_BLOOM_BYTES 256
+  #endif
+
+// Sorted map over 'units' 8KB blocks (at least 3)
+#define FlashSortedMap(name, units) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  FlashSortedMapClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units);
+#else
+  // Bloom filter bits per run segment: 512 for up to about 50 keys
+  #ifndef FLASHSORTEDMAP_BLOOM_BYTES
+    #define FLASHSORTEDMAP_BLOOM_BYTES 64
+  #endif
+
+// Sorted map over 'units' 1KB units (at least 3)
+#define FlashSortedMap(name, units) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*FLASHKV_UNIT_SIZE] = { }; \
+  FlashSortedMapClass name(FLASHSTORAGE_PPCAT(_data,name), FLASHKV_UNIT_SIZE, units);
+#endif
+
+class FlashSortedMapClass;
+
+// Position of a merge over the memtable and the sorted runs of a map
+class FlashSortedMapIterator {
+public:
+  // Move to the next key in order. Returns false once the scan is done.
+  bool next();
+
+  // Current key, NUL-terminated
+  const char *key() const { return last_key; }
+
+  uint16_t valueSize() const;
+
+  // Copy the current value. Returns false if its size differs from size.
+  bool value(void *value, uint16_t size) const;
+  template<class T> bool value(T *value) const { return this->value(value, sizeof(T)); }
+
+private:
+  friend class FlashSortedMapClass;
+
+  enum { BOUND_NONE, BOUND_PREFIX, BOUND_BELOW };
+
+  // Next entry of one run
+  struct RunCursor {
+    uint16_t unit;      // Unit holding the current segment
+    uint8_t segment;    // Position of that segment in the run
+    bool done;
+    uint16_t index;     // Entry within the segment
+  };
+
+  FlashSortedMapClass *map;
+  RunCursor cursors[FLASHSORTEDMAP_MAX_RUNS];
+  uint32_t location;    // Newest record of the current key
+  uint8_t first_run;    // Runs merged: first_run up to the newest
+  bool keep_removed;    // Also return removal markers (used by compaction)
+  bool inclusive;       // last_key is the lower bound, not a returned key
+  bool ended;
+  uint8_t last_len;
+  uint8_t bound;
+  uint8_t bound_len;
+  char last_key[FLASHKV_MAX_KEY_LENGTH + 1];
+  char bound_key[FLASHKV_MAX_KEY_LENGTH + 1];
+};
+
+// Ordered map of named values. New records are appended to a memtable unit
+// in flash, one record program per put(), like FlashKV. When the memtable is
+// full it is sorted into an immutable run: one or more units whose records
+// are in key order behind a Bloom filter and a table of record offsets, so
+// lookups skip segments that can't hold the key and binary search the rest,
+// and ordered scans read flash sequentially. After
+// FLASHSORTEDMAP_MAX_RUNS runs, the memtable and all runs are merged into a
+// single run and removed keys are dropped.
+//
+// A run only counts once its last segment header is in flash, and the units
+// it replaces are erased afterwards, so a reset at any point leaves either
+// the old or the new copy of every record readable. Merges need as many free
+// units as the run they produce, so keep about half of the units free.
+//
+// WARNING: Not interrupt-safe or thread-safe, same as FlashClass. Iterators
+// are invalidated by put(), remove() and compact().
+class FlashSortedMapClass {
+public:
+  FlashSortedMapClass(const void *flash_addr, uint32_t unit_bytes, uint32_t units);
+
+  // Store size bytes under key. Returns true on success, false if the key is
+  // invalid, the region is full, or on a flash error.
+  // Optimization: Skips the write if the stored value is unchanged.
+  bool put(const char *key, const void *value, uint16_t size);
+
+  // Copy the value stored under key. Returns false if the key is missing or
+  // its stored size differs from size.
+  bool get(const char *key, void *value, uint16_t size);
+
+  // Delete key. Returns false only on error; removing a missing key succeeds.
+  bool remove(const char *key);
+
+  bool contains(const char *key);
+
+  // Size of the value stored under key, 0 if the key is missing
+  uint16_t valueSize(const char *key);
+
+  // Number of keys currently stored. Walks the whole map.
+  uint32_t count();
+
+  // Keys starting with prefix, in order. An empty prefix scans everything.
+  FlashSortedMapIterator scan(const char *prefix = "");
+
+  // Keys from 'from' (inclusive) up to 'to' (exclusive), in order
+  FlashSortedMapIterator range(const char *from, const char *to);
+
+  // Merge the memtable and all runs into one run now
+  bool compact();
+
+  template<class T> bool put(const char *key, const T &value) { return put(key, &value, sizeof(T)); }
+  template<class T> bool get(const char *key, T *value) { return get(key, value, sizeof(T)); }
+
+private:
+  friend class FlashSortedMapIterator;
+
+  enum { RECORD_VALUE = 0x5A, RECORD_REMOVED = 0xA5 };
+  enum { RECORD_END, RECORD_VALID, RECORD_CORRUPT, RECORD_BROKEN };
+  static const uint32_t NO_RECORD = 0xFFFFFFFF;
+
+  // Starts every memtable unit and every run segment
+  struct UnitHeader {
+    uint16_t magic;       // Memtable or run segment
+    uint16_t checksum;    // Covers the fields below
+    uint32_t generation;  // Increases with every unit opened and every run written
+    uint32_t lo;          // Oldest generation merged into this run, own generation for a memtable
+    uint16_t entries;     // Records in this segment
+    uint8_t index;        // Position of this segment in its run
+    uint8_t last;         // Set on the final segment of a run, which is written last
+  };
+
+  // Same layout as FlashKV, so records are copied into runs unchanged
+  struct RecordHeader {
+    uint16_t key_hash;
+    uint8_t key_len;
+    uint8_t type;         // RECORD_VALUE or RECORD_REMOVED
+    uint16_t value_len;
+    uint16_t checksum;    // Covers the fields above, key and value
+  };
+
+  struct Run {
+    uint32_t generation;
+    uint32_t lo;
+    uint8_t segments;
+  };
+
+  static const uint32_t UNIT_HEADER_SIZE =
+    (sizeof(UnitHeader) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+
+  static uint32_t valueOffset(uint8_t key_len) {
+    return sizeof(RecordHeader) + ((key_len + 3) & ~3U);
+  }
+  static uint32_t recordSize(uint8_t key_len, uint16_t value_len) {
+    return (valueOffset(key_len) + value_len + FLASHSTORAGE_WRITE_GRANULE - 1) /
+           FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+  // Segment records start after the header, the Bloom filter and a uint16_t
+  // offset per entry
+  static const uint32_t OFFSETS_OFFSET = UNIT_HEADER_SIZE + FLASHSORTEDMAP_BLOOM_BYTES;
+  static uint32_t recordsOffset(uint32_t entries) {
+    return OFFSETS_OFFSET + (entries * sizeof(uint16_t) + FLASHSTORAGE_WRITE_GRANULE - 1) /
+           FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+  static uint32_t bloomHash(const volatile uint8_t *key, uint8_t key_len);
+  static void bloomAdd(uint8_t *bloom, uint32_t hash);
+  static uint16_t headerChecksum(const UnitHeader &header);
+  static uint16_t recordChecksum(const RecordHeader &header, const uint8_t *key, const uint8_t *value);
+  static int compareKeys(const volatile uint8_t *a, uint8_t a_len, const char *b, uint8_t b_len);
+
+  const volatile uint8_t *unitAddress(uint32_t unit) const { return base + unit * unit_size; }
+  const volatile RecordHeader *recordAt(uint32_t location) const {
+    return (const volatile RecordHeader *)(base + location);
+  }
+  const volatile uint8_t *keyAt(uint32_t location) const { return base + location + sizeof(RecordHeader); }
+
+  bool prepare(const char *key, uint8_t *key_len);
+  void mount();
+  bool readUnit(uint32_t unit, UnitHeader *header);
+  uint8_t readRecord(uint32_t unit, uint32_t offset, RecordHeader *header);
+  uint32_t find(const char *key, uint8_t key_len);
+
+  // Runs
+  uint32_t segmentUnit(uint32_t generation, uint8_t index);
+  uint16_t segmentEntries(uint32_t unit) const {
+    return ((const volatile UnitHeader *)unitAddress(unit))->entries;
+  }
+  uint32_t entryLocation(uint32_t unit, uint16_t index) const {
+    return unit * unit_size + ((const volatile uint16_t *)(unitAddress(unit) + OFFSETS_OFFSET))[index];
+  }
+  bool bloomMayContain(uint32_t unit, uint32_t hash) const;
+  uint32_t findInRun(uint8_t run, const char *key, uint8_t key_len, uint32_t hash);
+  void seekRun(uint8_t run, const char *key, uint8_t key_len, FlashSortedMapIterator::RunCursor *cursor);
+  void advanceRun(uint8_t run, FlashSortedMapIterator::RunCursor *cursor);
+
+  // Merging
+  void startMerge(FlashSortedMapIterator *it, uint8_t first_run, bool keep_removed,
+                  const char *lower, uint8_t lower_len);
+  bool mergeNext(FlashSortedMapIterator *it);
+  uint16_t packSegment(FlashSortedMapIterator *it, bool *more);
+  bool mergeRuns(uint8_t first_run);
+  bool flush();
+
+  // Memtable
+  uint32_t freeUnit();
+  uint32_t countFree();
+  bool openMemtable();
+  bool append(uint8_t type, const char *key, uint8_t key_len, const void *value, uint16_t value_len);
+
+  FlashClass flash;
+  const volatile uint8_t *base;
+  const uint32_t unit_size, unit_count;
+
+  // Found by mount(), runs oldest first. mount() may briefly see one run
+  // more than the limit, left by a reset right after a full merge.
+  bool mounted;
+  bool has_mem;
+  uint32_t mem_unit;
+  uint32_t write_offset;
+  uint32_t next_generation;
+  uint8_t run_count;
+  Run runs[FLASHSORTEDMAP_MAX_RUNS + 1];
+};
+
+#endif // FLASHSORTEDMAP_H
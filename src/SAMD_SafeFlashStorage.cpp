@@ -22,15 +22,30 @@
 
 static const uint32_t pageSizes[] = { 8, 16, 32, 64, 128, 256, 512, 1024 };
 
+// Total size of the main flash array: NVMP pages of PSZ bytes each
+static inline uint32_t flash_total_size()
+{
+  return NVMCTRL->PARAM.bit.NVMP * pageSizes[NVMCTRL->PARAM.bit.PSZ];
+}
+
 FlashClass::FlashClass(const void *flash_addr, uint32_t size) :
   PAGE_SIZE(pageSizes[NVMCTRL->PARAM.bit.PSZ]),
 #if defined(__SAMD51__)
-  ROW_SIZE((PAGE_SIZE * NVMCTRL->PARAM.bit.NVMP) >> 6),  // Divide by 64
+  ROW_SIZE(PAGE_SIZE << 4),  // Erase block is 16 pages (8KB) on every SAMD51
 #else
   ROW_SIZE(PAGE_SIZE << 2),  // Multiply by 4
 #endif
   flash_address((volatile void *)flash_addr),
-  flash_size(size)
+  flash_size(size),
+  op(OP_NONE),
+  op_ptr(NULL),
+  op_src(NULL),
+  op_remaining(0),
+  op_tail(0),
+  op_callback(NULL),
+  op_context(NULL),
+  op_rww(false),
+  op_blocking(false)
 {
 }
 
@@ -90,114 +105,147 @@ static void invalidate_CMCC_cache()
 }
 #endif
 
-bool FlashClass::write(const volatile void *flash_ptr, const void *data, uint32_t size)
-{
-  // Calculate actual bytes that will be written (round up to word boundary)
-  // This is necessary because we write in 32-bit words, so size gets rounded up
-  uint32_t actual_bytes = (size + 3) & ~3U;  // Round up to nearest multiple of 4
-  
-  // Bounds check with the actual size that will be written
-  if (!isWithinBounds(flash_ptr, actual_bytes)) {
-    return false;
-  }
-  
-  // Disable interrupts during flash operations to prevent ISR conflicts
-  noInterrupts();
-  
-  // Convert size to 32-bit words
-  size = actual_bytes >> 2;
-  volatile uint32_t *dst_addr = (volatile uint32_t *)flash_ptr;
-  const uint8_t *src_addr = (uint8_t *)data;
-  const uint32_t words_per_page = PAGE_SIZE >> 2;  // Divide by 4 (bytes per word)
+// Only one NVM operation can be in flight at a time, whichever instance started it
+FlashClass * volatile FlashClass::active = NULL;
+bool FlashClass::interrupt_driven = false;
 
-  // Disable automatic page write
+// Returns true once the last NVM command has completed
+static inline bool nvm_ready()
+{
 #if defined(__SAMD51__)
-  NVMCTRL->CTRLA.bit.WMODE = 0;
-  while (NVMCTRL->STATUS.bit.READY == 0) { }
-  // Disable NVMCTRL cache while writing, per SAMD51 errata.
-  bool original_CACHEDIS0 = NVMCTRL->CTRLA.bit.CACHEDIS0;
-  bool original_CACHEDIS1 = NVMCTRL->CTRLA.bit.CACHEDIS1;
-  NVMCTRL->CTRLA.bit.CACHEDIS0 = true;
-  NVMCTRL->CTRLA.bit.CACHEDIS1 = true;
+  return NVMCTRL->STATUS.bit.READY;
 #else
-  NVMCTRL->CTRLB.bit.MANW = 1;
+  return NVMCTRL->INTFLAG.bit.READY;
 #endif
+}
 
-  // Do writes in pages
-  while (size) {
-    // Execute "PBC" Page Buffer Clear
+static inline void nvm_wait_ready()
+{
+  while (!nvm_ready()) { }
+}
+
+// Issue an NVM command without waiting for it to complete
+static inline void nvm_command(uint32_t cmd)
+{
 #if defined(__SAMD51__)
-    NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_PBC;
-    while (NVMCTRL->INTFLAG.bit.DONE == 0) { }
+  NVMCTRL->INTFLAG.reg = NVMCTRL_INTFLAG_DONE;  // Clear completion flag so the interrupt fires for this command
+  NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | cmd;
+  // Invalidate CMCC cache before waiting to prevent stale reads
+  invalidate_CMCC_cache();
 #else
-    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_PBC;
-    while (NVMCTRL->INTFLAG.bit.READY == 0) { }
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
 #endif
+}
 
-    // Fill page buffer
-    uint32_t i;
-    for (i=0; i<words_per_page && size; i++) {
-      *dst_addr = read_unaligned_uint32(src_addr);
-      src_addr += 4;
-      dst_addr++;
-      size--;
-    }
+#if !defined(__SAMD51__) && defined(NVMCTRL_RWW_EEPROM_ADDR)
+// Size of the separate RWWEE array on SAMD21 parts that have one, 0 otherwise
+static inline uint32_t rwwee_size()
+{
+  uint32_t pages = (NVMCTRL->PARAM.reg >> 20) & 0xFFF;  // RWWEEP field, bits 31:20
+  return pages * pageSizes[NVMCTRL->PARAM.bit.PSZ];
+}
+
+// Returns true if the range lies entirely in the RWWEE array, which can be
+// erased and programmed while the CPU keeps fetching from the main array
+static bool in_rwwee(uintptr_t addr, uint32_t size)
+{
+  uint32_t total = rwwee_size();
+  return addr >= NVMCTRL_RWW_EEPROM_ADDR && size <= total &&
+         addr - NVMCTRL_RWW_EEPROM_ADDR <= total - size;
+}
+#endif
+
+#if defined(FLASHSTORAGE_RAMFUNC)
+// NVIC enable words covering every peripheral interrupt
+#define FLASHSTORAGE_NVIC_WORDS ((PERIPH_COUNT_IRQn + 31) / 32)
 
-    // Execute "WP" Write Page
+// Peripheral interrupts left enabled while an NVM command runs from SRAM
+static uint32_t ram_safe_irqs[FLASHSTORAGE_NVIC_WORDS];
+
+// Issue an NVM command and wait for it entirely from SRAM, so the CPU never
+// fetches from flash while the controller is busy. Must not call into flash.
+FLASHSTORAGE_RAMFUNC_ATTR static void nvm_command_wait_from_ram(uint32_t cmd)
+{
 #if defined(__SAMD51__)
-    NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_WP;
-    // Invalidate CMCC cache before waiting to prevent stale reads
-    invalidate_CMCC_cache();
-    while (NVMCTRL->INTFLAG.bit.DONE == 0) { }
+  NVMCTRL->INTFLAG.reg = NVMCTRL_INTFLAG_DONE;
+  NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | cmd;
+  while (!NVMCTRL->STATUS.bit.READY) { }
 #else
-    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_WP;
-    while (NVMCTRL->INTFLAG.bit.READY == 0) { }
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
+  while (!NVMCTRL->INTFLAG.bit.READY) { }
 #endif
+}
+
+// Run one command from SRAM with only the interrupts registered through
+// allowDuringFlash() enabled. Called with interrupts disabled.
+static void ram_command_wait(uint32_t cmd)
+{
+  uint32_t saved[FLASHSTORAGE_NVIC_WORDS];
+  bool any_allowed = false;
+  for (uint32_t i = 0; i < FLASHSTORAGE_NVIC_WORDS; i++) {
+    any_allowed |= (ram_safe_irqs[i] != 0);
+  }
+  
+  if (!any_allowed) {
+    nvm_command_wait_from_ram(cmd);
+  } else {
+    // Mask everything whose handler may live in flash, including SysTick
+    for (uint32_t i = 0; i < FLASHSTORAGE_NVIC_WORDS; i++) {
+      saved[i] = NVIC->ISER[i];
+      NVIC->ICER[i] = saved[i] & ~ram_safe_irqs[i];
+    }
+    uint32_t systick = SysTick->CTRL & SysTick_CTRL_TICKINT_Msk;
+    SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+    __DSB();
+    __ISB();
+    
+    __enable_irq();
+    nvm_command_wait_from_ram(cmd);
+    __disable_irq();
+    
+    // Masked interrupts stay pending and are served once interrupts are restored
+    SysTick->CTRL |= systick;
+    for (uint32_t i = 0; i < FLASHSTORAGE_NVIC_WORDS; i++) {
+      NVIC->ISER[i] = saved[i];
+    }
   }
   
 #if defined(__SAMD51__)
-  // Restore original NVMCTRL cache settings after all writes complete
-  NVMCTRL->CTRLA.bit.CACHEDIS0 = original_CACHEDIS0;
-  NVMCTRL->CTRLA.bit.CACHEDIS1 = original_CACHEDIS1;
-  // Memory barrier to ensure flash write completion before subsequent reads
-  __DSB();
+  invalidate_CMCC_cache();
 #endif
-  
-  // Re-enable interrupts
-  interrupts();
-  
-  return true;
 }
 
-bool FlashClass::erase(const volatile void *flash_ptr, uint32_t size)
+void FlashClass::allowDuringFlash(IRQn_Type irq)
 {
-  // Bounds check before erasing
-  if (!isWithinBounds(flash_ptr, size)) {
-    return false;
+  if (irq >= 0) {
+    ram_safe_irqs[((uint32_t)irq) >> 5] |= (1UL << (((uint32_t)irq) & 31));
   }
-  
-  // Disable interrupts during flash operations to prevent ISR conflicts
-  noInterrupts();
-  
-  const uint8_t *ptr = (const uint8_t *)flash_ptr;
-  while (size > ROW_SIZE) {
-    if (!erase(ptr)) {
-      interrupts();  // Re-enable interrupts before returning
-      return false;  // Erase failed - out of bounds
-    }
-    ptr += ROW_SIZE;
-    size -= ROW_SIZE;
+}
+
+// Vector table copy in SRAM; VTOR needs alignment to the table size rounded up to a power of two
+#if defined(__SAMD51__)
+__attribute__((__aligned__(1024)))
+#else
+__attribute__((__aligned__(256)))
+#endif
+static uint32_t ram_vectors[16 + PERIPH_COUNT_IRQn];
+
+void FlashClass::relocateVectorTable()
+{
+  const uint32_t *flash_vectors = (const uint32_t *)(uintptr_t)SCB->VTOR;
+  if (flash_vectors == ram_vectors) {
+    return;  // Already relocated
   }
-  // Erase remaining partial or full row if any data remains
-  bool result = (size > 0) ? erase(ptr) : true;
   
-  // Re-enable interrupts
+  noInterrupts();
+  memcpy(ram_vectors, flash_vectors, sizeof(ram_vectors));
+  SCB->VTOR = (uint32_t)(uintptr_t)ram_vectors;
+  __DSB();
   interrupts();
-  
-  return result;
 }
+#endif
 
-bool FlashClass::erase(const volatile void *flash_ptr)
+bool FlashClass::isRowErasable(const volatile void *flash_ptr) const
 {
   // Check that flash_ptr is row-aligned and within reasonable flash range
   // Note: We don't check against flash_size here because erasing requires
@@ -210,48 +258,1331 @@ bool FlashClass::erase(const volatile void *flash_ptr)
   }
   
   // Verify it's in flash memory range by reading actual device flash size
-  // NVMP = # of NVM pages
-  // For SAMD21: NVMP * PAGE_SIZE = total flash
-  // For SAMD51: NVMP represents blocks of 64 rows, so total flash = NVMP * PAGE_SIZE * 64
-#if defined(__SAMD51__)
-  uint32_t flash_size_bytes = NVMCTRL->PARAM.bit.NVMP * PAGE_SIZE << 6;  // Multiply by 64
-#else
-  uint32_t flash_size_bytes = NVMCTRL->PARAM.bit.NVMP * PAGE_SIZE;
+#if !defined(__SAMD51__) && defined(NVMCTRL_RWW_EEPROM_ADDR)
+  if (in_rwwee(addr, ROW_SIZE)) {
+    return true;
+  }
 #endif
-  if (addr >= flash_size_bytes) {
+  return addr < flash_total_size();
+}
+
+#if defined(__SAMD51__)
+// Program image bounds from the core's linker script (weak: 0 if not provided)
+extern "C" {
+  extern char __etext[] __attribute__((weak));
+  extern char __data_start__[] __attribute__((weak));
+  extern char __data_end__[] __attribute__((weak));
+}
+
+// Returns true if the range lies entirely in the flash bank that the running
+// code does not execute from. SAMD51 splits the main array into two equal banks,
+// and either bank can be programmed while the CPU keeps fetching from the other.
+static bool in_other_bank(uintptr_t addr, uint32_t size)
+{
+  uint32_t total = flash_total_size();
+  uint32_t half = total >> 1;
+  uintptr_t code = (uintptr_t)&in_other_bank;  // This library runs from the same bank as the sketch
+  
+  if (addr > total || size > total - addr) {
     return false;
   }
   
+  bool target_upper = (addr >= half);
+  if (target_upper == (code >= half)) {
+    return false;  // Same bank as the running code
+  }
+  
+  // A lower-bank range must not spill over into the upper bank
+  return target_upper || addr + size <= half;
+}
+
+const void *FlashClass::otherBankAddress(uint32_t offset, uint32_t size)
+{
+  uint32_t total = flash_total_size();
+  uint32_t half = total >> 1;
+  uintptr_t code = (uintptr_t)&in_other_bank;
+  uintptr_t bank_end = (code >= half) ? half : total;
+  uint32_t bank_size = half;
+  
+  // SmartEEPROM takes the last 2 * SBLK blocks of the array when the fuses enable it
+  if (bank_end == total) {
+    uint32_t seeprom = NVMCTRL->SEESTAT.bit.SBLK * 2 * (pageSizes[NVMCTRL->PARAM.bit.PSZ] << 4);
+    if (seeprom >= half) {
+      return NULL;
+    }
+    bank_end -= seeprom;
+    bank_size -= seeprom;
+  }
+  
+  if (offset > bank_size || size > bank_size - offset) {
+    return NULL;  // Does not fit in one bank
+  }
+  
+  uintptr_t addr = bank_end - offset - size;
+  if (addr % (pageSizes[NVMCTRL->PARAM.bit.PSZ] << 4) != 0) {
+    return NULL;  // Must start on an erase block
+  }
+  
+  // Never hand out space that overlaps the program image (code + initialized data)
+  uintptr_t image_end = (uintptr_t)__etext + ((uintptr_t)__data_end__ - (uintptr_t)__data_start__);
+  if (__etext == NULL || addr < image_end) {
+    return NULL;
+  }
+  
+  return (const void *)addr;
+}
+
+#endif
+
+// Returns true if the CPU can keep fetching code while the range is erased or programmed
+static bool is_read_while_write(uintptr_t addr, uint32_t size)
+{
 #if defined(__SAMD51__)
-  NVMCTRL->ADDR.reg = ((uint32_t)flash_ptr);
-  NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CMDEX_KEY | NVMCTRL_CTRLB_CMD_EB;
-  // Invalidate CMCC cache before waiting to prevent stale reads
-  invalidate_CMCC_cache();
-  while (!NVMCTRL->INTFLAG.bit.DONE) { }
-  // Memory barrier to ensure erase completion
-  __DSB();
+  return in_other_bank(addr, size);
+#elif defined(NVMCTRL_RWW_EEPROM_ADDR)
+  return in_rwwee(addr, size);
 #else
-  NVMCTRL->ADDR.reg = ((uint32_t)flash_ptr) >> 1;  // Convert byte address to word address
-  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_ER;
-  while (!NVMCTRL->INTFLAG.bit.READY) { }
+  (void)addr;
+  (void)size;
+  return false;
 #endif
-  
-  return true;
 }
 
-bool FlashClass::read(const volatile void *flash_ptr, void *data, uint32_t size)
+bool FlashClass::isReadWhileWrite() const
 {
-  // Bounds check before reading
-  if (!isWithinBounds(flash_ptr, size)) {
+  return flash_address != NULL && is_read_while_write((uintptr_t)flash_address, flash_size);
+}
+
+#if !defined(__SAMD51__)
+const void *FlashClass::rwweeAddress(uint32_t offset, uint32_t size, const void *fallback)
+{
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+  uintptr_t addr = NVMCTRL_RWW_EEPROM_ADDR + offset;
+  if (offset % (pageSizes[NVMCTRL->PARAM.bit.PSZ] << 2) == 0 && in_rwwee(addr, size)) {
+    return (const void *)addr;
+  }
+#else
+  (void)offset;
+  (void)size;
+#endif
+  return fallback;  // No RWWEE array on this part, or the region does not fit
+}
+#endif
+
+void FlashClass::startOperation(uint8_t kind, const volatile void *flash_ptr, const void *data, uint32_t size)
+{
+  op = kind;
+  op_ptr = (const volatile uint8_t *)flash_ptr;
+  op_src = (const uint8_t *)data;
+  op_remaining = (kind == OP_WRITE) ? ((size + 3) & ~3U) : size;  // Writes go in whole words
+  op_tail = op_remaining - size;  // Bytes past the end of the source in the last word
+  op_blocking = false;
+  active = this;
+  op_rww = is_read_while_write((uintptr_t)flash_ptr, size);
+
+#if defined(__SAMD51__)
+  // Disable automatic page write
+  NVMCTRL->CTRLA.bit.WMODE = 0;
+  while (NVMCTRL->STATUS.bit.READY == 0) { }
+  // Disable NVMCTRL cache while writing, per SAMD51 errata.
+  op_cachedis0 = NVMCTRL->CTRLA.bit.CACHEDIS0;
+  op_cachedis1 = NVMCTRL->CTRLA.bit.CACHEDIS1;
+  NVMCTRL->CTRLA.bit.CACHEDIS0 = true;
+  NVMCTRL->CTRLA.bit.CACHEDIS1 = true;
+#else
+  // Disable automatic page write
+  NVMCTRL->CTRLB.bit.MANW = 1;
+#endif
+}
+
+void FlashClass::issueStep()
+{
+  while (op_remaining && skipErasedRow()) { }
+  if (op_remaining) {
+    nvm_command(prepareStep());
+  }
+}
+
+bool FlashClass::skipErasedRow()
+{
+  // An erase of a row that already reads back all 0xFF would only cost time
+  // and an endurance cycle. The scan stops at the first programmed word.
+  if (op != OP_ERASE || !isErased(op_ptr, ROW_SIZE)) {
     return false;
   }
   
-  memcpy(data, (const void *)flash_ptr, size);
-  
+  op_ptr += ROW_SIZE;
+  op_remaining = (op_remaining > ROW_SIZE) ? op_remaining - ROW_SIZE : 0;
+  return true;
+}
+
+uint32_t FlashClass::prepareStep()
+{
+  if (op == OP_ERASE) {
+    // Erase one row (SAMD21) or block (SAMD51)
+    const volatile uint8_t *row = op_ptr;
+    op_ptr += ROW_SIZE;
+    op_remaining = (op_remaining > ROW_SIZE) ? op_remaining - ROW_SIZE : 0;
 #if defined(__SAMD51__)
-  // Memory barrier to ensure read completes before returning
+    NVMCTRL->ADDR.reg = ((uint32_t)row);
+    return NVMCTRL_CTRLB_CMD_EB;
+#else
+    NVMCTRL->ADDR.reg = ((uint32_t)row) >> 1;  // Convert byte address to word address
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+    return op_rww ? NVMCTRL_CTRLA_CMD_RWWEEER : NVMCTRL_CTRLA_CMD_ER;
+#else
+    return NVMCTRL_CTRLA_CMD_ER;
+#endif
+#endif
+  }
+
+  // Execute "PBC" Page Buffer Clear
+#if defined(__SAMD51__)
+  nvm_command(NVMCTRL_CTRLB_CMD_PBC);
+#else
+  nvm_command(NVMCTRL_CTRLA_CMD_PBC);
+#endif
+  nvm_wait_ready();
+
+  // Fill page buffer, stopping at the page boundary so writes that start
+  // part-way into a page never wrap around the page buffer
+  volatile uint32_t *dst_addr = (volatile uint32_t *)op_ptr;
+  const uint32_t words_per_page = PAGE_SIZE >> 2;  // Divide by 4 (bytes per word)
+  uint32_t i = (((uintptr_t)dst_addr) & (PAGE_SIZE - 1)) >> 2;
+  for (; i<words_per_page && op_remaining; i++) {
+    if (op_remaining == 4 && op_tail) {
+      // Pad the last partial word with 0xFF (leaves those bits unprogrammed)
+      // instead of reading past the end of the source buffer
+      uint32_t word = 0xFFFFFFFF;
+      memcpy(&word, op_src, 4 - op_tail);
+      *dst_addr = word;
+    } else {
+      *dst_addr = read_unaligned_uint32(op_src);
+    }
+    op_src += 4;
+    dst_addr++;
+    op_remaining -= 4;
+  }
+  op_ptr = (const volatile uint8_t *)dst_addr;
+
+  // "WP" Write Page is issued by the caller
+#if defined(__SAMD51__)
+  return NVMCTRL_CTRLB_CMD_WP;
+#elif defined(NVMCTRL_RWW_EEPROM_ADDR)
+  return op_rww ? NVMCTRL_CTRLA_CMD_RWWEEWP : NVMCTRL_CTRLA_CMD_WP;
+#else
+  return NVMCTRL_CTRLA_CMD_WP;
+#endif
+}
+
+void FlashClass::finishOperation()
+{
+#if defined(__SAMD51__)
+  // Restore original NVMCTRL cache settings after all writes complete
+  NVMCTRL->CTRLA.bit.CACHEDIS0 = op_cachedis0;
+  NVMCTRL->CTRLA.bit.CACHEDIS1 = op_cachedis1;
+  // Memory barrier to ensure flash write completion before subsequent reads
   __DSB();
 #endif
+
+  if (interrupt_driven) {
+    setCompletionInterrupt(false);
+  }
+
+  op = OP_NONE;
+  active = NULL;
+}
+
+void FlashClass::setCompletionInterrupt(bool enable)
+{
+#if defined(__SAMD51__)
+  if (enable) {
+    NVMCTRL->INTENSET.reg = NVMCTRL_INTENSET_DONE;
+  } else {
+    NVMCTRL->INTENCLR.reg = NVMCTRL_INTENCLR_DONE;
+    NVMCTRL->INTFLAG.reg = NVMCTRL_INTFLAG_DONE;
+  }
+#else
+  if (enable) {
+    NVMCTRL->INTENSET.reg = NVMCTRL_INTENSET_READY;
+  } else {
+    NVMCTRL->INTENCLR.reg = NVMCTRL_INTENCLR_READY;
+  }
+#endif
+}
+
+// Interrupts-off window bookkeeping for blocking operations
+static uint32_t critical_limit_us = 0;  // 0 = keep interrupts off for the whole operation
+static uint32_t critical_worst_us = 0;
+static bool critical_timing = false;    // Windows are only timed while a limit is set
+
+// micros() counts SysTick interrupts, so with interrupts masked it misses every
+// wrap after the first and under-reports windows longer than a millisecond.
+// The windows are timed with a hardware counter instead.
+#if defined(__SAMD51__)
+// Cortex-M4: the DWT cycle counter runs regardless of interrupts
+static uint32_t critical_start_cycles = 0;
+
+static inline void critical_clock_start()
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  critical_start_cycles = DWT->CYCCNT;
+}
+
+static inline uint32_t critical_clock_us()
+{
+  return (DWT->CYCCNT - critical_start_cycles) / (SystemCoreClock / 1000000);
+}
+
+static inline void critical_clock_stop() { }
+#else
+// Cortex-M0+ has no cycle counter, so SysTick itself is used. Its reload value
+// is raised to the maximum for the window: the tick in progress still ends on
+// time, and every later period (about 350ms at 48MHz) is far longer than one
+// NVM command, so sampling once per command sees each wrap.
+static uint32_t critical_saved_load = 0;
+static uint32_t critical_last_val = 0;
+static uint32_t critical_cycles = 0;
+static bool critical_wrapped = false;
+
+static inline void critical_clock_start()
+{
+  critical_saved_load = SysTick->LOAD;
+  critical_last_val = SysTick->VAL;
+  critical_cycles = 0;
+  critical_wrapped = false;
+  SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;  // Takes effect at the next reload
+}
+
+static inline uint32_t critical_clock_us()
+{
+  uint32_t val = SysTick->VAL;
+  if (val <= critical_last_val) {
+    critical_cycles += critical_last_val - val;
+  } else {
+    // Counted down to 0, then reloaded with the stretched period
+    critical_cycles += critical_last_val + 1 + (SysTick_LOAD_RELOAD_Msk - val);
+    critical_wrapped = true;
+  }
+  critical_last_val = val;
+  return critical_cycles / (SystemCoreClock / 1000000);
+}
+
+static inline void critical_clock_stop()
+{
+  SysTick->LOAD = critical_saved_load;
+  if (critical_wrapped) {
+    // Start a fresh tick and make sure the one that ended is counted
+    SysTick->VAL = 0;
+    SCB->ICSR = SCB_ICSR_PENDSTSET_Msk;
+  }
+}
+#endif
+
+// Without a limit nothing is timed, so SysTick is left alone on SAMD21
+static inline void enter_critical()
+{
+  noInterrupts();
+  critical_timing = (critical_limit_us != 0);
+  if (critical_timing) {
+    critical_clock_start();
+  }
+}
+
+static inline void leave_critical()
+{
+  if (critical_timing) {
+    uint32_t elapsed = critical_clock_us();
+    if (elapsed > critical_worst_us) {
+      critical_worst_us = elapsed;
+    }
+    critical_clock_stop();
+  }
+  interrupts();
+}
+
+void FlashClass::setMaxCriticalSection(uint32_t us)
+{
+  critical_limit_us = us;
+}
+
+uint32_t FlashClass::maxInterruptsOff()
+{
+  return critical_worst_us;
+}
+
+void FlashClass::resetInterruptsOffStats()
+{
+  critical_worst_us = 0;
+}
+
+void FlashClass::runBlocking()
+{
+  while (op_remaining) {
+    if (skipErasedRow()) {
+      continue;
+    }
+    
+    uint32_t command_start_us = critical_timing ? critical_clock_us() : 0;
+    uint32_t cmd = prepareStep();
+    if (op_rww) {
+      // Code keeps running from the array not being written, so interrupts can
+      // be served while the command is in flight; the in-flight marker keeps
+      // ISRs from starting a competing operation
+      nvm_command(cmd);
+      leave_critical();
+      nvm_wait_ready();
+      enter_critical();
+      continue;
+    }
+#if defined(FLASHSTORAGE_RAMFUNC)
+    ram_command_wait(cmd);
+#else
+    nvm_command(cmd);
+    nvm_wait_ready();
+#endif
+    
+    // The NVM controller is idle between commands, so pending interrupts can be
+    // served safely here if the next command could push past the configured limit
+    if (critical_timing && op_remaining) {
+      uint32_t now = critical_clock_us();
+      if (now + (now - command_start_us) > critical_limit_us) {
+        leave_critical();
+        enter_critical();
+      }
+    }
+  }
+}
+
+bool FlashClass::enterBlocking()
+{
+  enter_critical();
   
+  // The controller runs one operation at a time, so drive a non-blocking one
+  // still in flight to completion first (its callback runs from here)
+  while (active != NULL) {
+    FlashClass *flash = active;
+    if (flash->op_blocking) {
+      // Only reachable from an ISR that interrupted a blocking operation
+      // between commands; that operation cannot be advanced from here
+      leave_critical();
+      return false;
+    }
+    leave_critical();
+    while (flash->poll()) { }
+    enter_critical();
+  }
   return true;
-}
\ No newline at end of file
+}
+
+bool FlashClass::write(const volatile void *flash_ptr, const void *data, uint32_t size)
+{
+  // Calculate actual bytes that will be written (round up to word boundary)
+  // This is necessary because we write in 32-bit words, so size gets rounded up
+  uint32_t actual_bytes = (size + 3) & ~3U;  // Round up to nearest multiple of 4
+  
+  // Bounds check with the actual size that will be written
+  if (!isWithinBounds(flash_ptr, actual_bytes)) {
+    return false;
+  }
+  
+  // Disable interrupts during flash operations to prevent ISR conflicts
+  if (!enterBlocking()) {
+    return false;
+  }
+  
+  // Do writes in pages
+  startOperation(OP_WRITE, flash_ptr, data, size);
+  op_blocking = true;
+  runBlocking();
+  finishOperation();
+  
+  // Re-enable interrupts
+  leave_critical();
+  
+  return true;
+}
+
+bool FlashClass::erase(const volatile void *flash_ptr, uint32_t size)
+{
+  // Bounds check before erasing
+  if (!isWithinBounds(flash_ptr, size)) {
+    return false;
+  }
+  
+  if (size == 0) {
+    return true;
+  }
+  
+  // Rows are contiguous, so validating the first and last covers the whole range
+  const uint8_t *last_row = (const uint8_t *)flash_ptr + ((size - 1) / ROW_SIZE) * ROW_SIZE;
+  if (!isRowErasable(flash_ptr) || !isRowErasable(last_row)) {
+    return false;  // Erase failed - misaligned or out of bounds
+  }
+  
+  // Disable interrupts during flash operations to prevent ISR conflicts
+  if (!enterBlocking()) {
+    return false;
+  }
+  
+  startOperation(OP_ERASE, flash_ptr, NULL, size);
+  op_blocking = true;
+  runBlocking();
+  finishOperation();
+  
+  // Re-enable interrupts
+  leave_critical();
+  
+  return true;
+}
+
+bool FlashClass::beginWrite(const volatile void *flash_ptr, const void *data, uint32_t size, FlashCallback callback, void *context)
+{
+  uint32_t actual_bytes = (size + 3) & ~3U;  // Round up to nearest multiple of 4
+  
+  if (!isWithinBounds(flash_ptr, actual_bytes)) {
+    return false;
+  }
+  
+  noInterrupts();
+  if (active != NULL || !nvm_ready()) {
+    interrupts();
+    return false;  // Another operation is still in flight
+  }
+  
+  op_callback = callback;
+  op_context = context;
+  startOperation(OP_WRITE, flash_ptr, data, size);
+  issueStep();  // First page program; later ones are issued by poll()
+  if (interrupt_driven) {
+    setCompletionInterrupt(true);
+  }
+  interrupts();
+  
+  return true;
+}
+
+bool FlashClass::beginErase(const volatile void *flash_ptr, uint32_t size, FlashCallback callback, void *context)
+{
+  if (!isWithinBounds(flash_ptr, size) || size == 0) {
+    return false;
+  }
+  
+  // Validate the first and last rows up front, since they are erased later from poll()
+  const uint8_t *last_row = (const uint8_t *)flash_ptr + ((size - 1) / ROW_SIZE) * ROW_SIZE;
+  if (!isRowErasable(flash_ptr) || !isRowErasable(last_row)) {
+    return false;
+  }
+  
+  noInterrupts();
+  if (active != NULL || !nvm_ready()) {
+    interrupts();
+    return false;  // Another operation is still in flight
+  }
+  
+  op_callback = callback;
+  op_context = context;
+  startOperation(OP_ERASE, flash_ptr, NULL, size);
+  issueStep();  // First row erase; later ones are issued by poll()
+  if (interrupt_driven) {
+    setCompletionInterrupt(true);
+  }
+  interrupts();
+  
+  return true;
+}
+
+bool FlashClass::poll()
+{
+  // Preserve the caller's interrupt state so poll() is also safe inside the NVMCTRL ISR
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  
+  if (op == OP_NONE || !nvm_ready()) {
+    bool busy = (op != OP_NONE);
+    if (!primask) __enable_irq();
+    return busy;
+  }
+  
+  // Previous command is done: issue the next one or finish
+  if (op_remaining) {
+    issueStep();
+    if (!primask) __enable_irq();
+    return true;
+  }
+  
+  FlashCallback callback = op_callback;
+  op_callback = NULL;
+  finishOperation();
+  if (!primask) __enable_irq();
+  
+  // Notify outside the critical section so the callback may start a new operation
+  if (callback) {
+    callback(op_context);
+  }
+  return false;
+}
+
+void FlashClass::useInterrupt(bool enable)
+{
+  interrupt_driven = enable;
+#if defined(__SAMD51__)
+  if (enable) {
+    NVIC_EnableIRQ(NVMCTRL_0_IRQn);
+  }
+#else
+  if (enable) {
+    NVIC_EnableIRQ(NVMCTRL_IRQn);
+  }
+#endif
+}
+
+void FlashClass::handleInterrupt()
+{
+  FlashClass *flash = active;
+  if (flash != NULL) {
+    flash->poll();
+  } else {
+    setCompletionInterrupt(false);  // Nothing in flight, silence the interrupt
+  }
+}
+
+bool FlashClass::canOverwrite(const volatile void *flash_ptr, const void *data, uint32_t size) const
+{
+  const volatile uint8_t *dst = (const volatile uint8_t *)flash_ptr;
+  const uint8_t *src = (const uint8_t *)data;
+  for (uint32_t i = 0; i < size; i++) {
+    uint8_t current = dst[i];
+    if (src[i] & ~current) {
+      return false;  // A bit would have to go from 0 to 1
+    }
+#if defined(__SAMD51__)
+    // Each ECC quad-word can only be programmed once per erase, so one that
+    // changes must still be blank
+    if (src[i] != current &&
+        !isErased((const volatile uint8_t *)((uintptr_t)(dst + i) & ~(uintptr_t)(FLASHSTORAGE_WRITE_GRANULE - 1)),
+                  FLASHSTORAGE_WRITE_GRANULE)) {
+      return false;
+    }
+#endif
+  }
+  return true;
+}
+
+bool FlashClass::overwrite(const volatile void *flash_ptr, const void *data, uint32_t size)
+{
+  if (!isWithinBounds(flash_ptr, (size + 3) & ~3U)) {
+    return false;
+  }
+  
+  if (!canOverwrite(flash_ptr, data, size)) {
+    return false;  // Needs an erase
+  }
+  
+  // Program each run of granules that holds a changed byte, so unchanged
+  // granules between them are left alone
+  const volatile uint8_t *dst = (const volatile uint8_t *)flash_ptr;
+  const uint8_t *src = (const uint8_t *)data;
+  uint32_t run = size;  // Start of the run being collected, size while none
+  for (uint32_t pos = 0, end; pos < size; pos = end) {
+    end = pos + FLASHSTORAGE_WRITE_GRANULE - ((uintptr_t)(dst + pos) & (FLASHSTORAGE_WRITE_GRANULE - 1));
+    if (end > size) {
+      end = size;
+    }
+    bool changed = false;
+    for (uint32_t i = pos; i < end && !changed; i++) {
+      changed = (src[i] != dst[i]);
+    }
+    if (changed && run == size) {
+      run = pos;
+    } else if (!changed && run != size) {
+      if (!write(dst + run, src + run, pos - run)) {
+        return false;
+      }
+      run = size;
+    }
+  }
+  return run == size || write(dst + run, src + run, size - run);
+}
+
+// Bytes pos..pos+n-1 of a record assembled from parts
+static void fill_parts(uint8_t *chunk, uint32_t pos, uint32_t n, const FlashPart *parts, uint32_t count)
+{
+  memset(chunk, 0xFF, n);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t from = parts[i].offset > pos ? parts[i].offset : pos;
+    uint32_t to = (parts[i].offset + parts[i].size < pos + n) ? parts[i].offset + parts[i].size : pos + n;
+    if (from < to) {
+      memcpy(chunk + (from - pos), (const uint8_t *)parts[i].data + (from - parts[i].offset), to - from);
+    }
+  }
+}
+
+bool FlashClass::writeParts(const volatile void *flash_ptr, uint32_t size, const FlashPart *parts, uint32_t count,
+                            uint32_t head)
+{
+  const volatile uint8_t *dst = (const volatile uint8_t *)flash_ptr;
+  uint8_t chunk[FLASHSTORAGE_PAGE_BYTES];
+  
+  head = (head + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  if (head > size) {
+    head = size;
+  }
+  
+  // Everything after the head, up to a page per program
+  for (uint32_t pos = head, n; pos < size; pos += n) {
+    n = FLASHSTORAGE_PAGE_BYTES - ((uintptr_t)(dst + pos) & (FLASHSTORAGE_PAGE_BYTES - 1));
+    if (n > size - pos) {
+      n = size - pos;
+    }
+    fill_parts(chunk, pos, n, parts, count);
+    if (!write(dst + pos, chunk, n)) {
+      return false;
+    }
+  }
+  
+  fill_parts(chunk, 0, head, parts, count);
+  return write(dst, chunk, head);
+}
+
+bool FlashClass::isErased(const volatile void *flash_ptr, uint32_t size) const
+{
+  const volatile uint8_t *ptr = (const volatile uint8_t *)flash_ptr;
+  
+  // Scan leading bytes up to the first word boundary
+  while (size && (((uintptr_t)ptr) & 3) != 0) {
+    if (*ptr != 0xFF) {
+      return false;
+    }
+    ptr++;
+    size--;
+  }
+  
+  // Scan whole 32-bit words, then any trailing bytes
+  while (size >= 4) {
+    if (*(const volatile uint32_t *)ptr != 0xFFFFFFFF) {
+      return false;
+    }
+    ptr += 4;
+    size -= 4;
+  }
+  
+  while (size) {
+    if (*ptr != 0xFF) {
+      return false;
+    }
+    ptr++;
+    size--;
+  }
+  
+  return true;
+}
+
+bool FlashClass::read(const volatile void *flash_ptr, void *data, uint32_t size)
+{
+  // Bounds check before reading
+  if (!isWithinBounds(flash_ptr, size)) {
+    return false;
+  }
+  
+  memcpy(data, (const void *)flash_ptr, size);
+  
+#if defined(__SAMD51__)
+  // Memory barrier to ensure read completes before returning
+  __DSB();
+#endif
+  
+  return true;
+}
+
+// Instances with background work, linked at construction time
+static FlashIdleHook *idle_hooks = NULL;
+
+void FlashStorageInternal::registerIdleHook(FlashIdleHook *hook)
+{
+  hook->next = idle_hooks;
+  idle_hooks = hook;
+}
+
+bool flashIdle()
+{
+  bool pending = false;
+  for (FlashIdleHook *hook = idle_hooks; hook != NULL; hook = hook->next) {
+    pending |= hook->run(hook->context);
+  }
+  return pending;
+}
+
+FlashCounterClass::FlashCounterClass(const void *flash_addr, uint16_t var_hash, uint32_t unit_bytes) :
+  flash(flash_addr, unit_bytes * 2),
+  variable_hash(var_hash),
+  base_address((const volatile uint8_t *)flash_addr),
+  unit_size(unit_bytes),
+  cell_count((unit_bytes - HEADER_SIZE) / CELL_SIZE),
+  mounted(false),
+  valid(false),
+  active_unit(0),
+  base(0),
+  cell_index(0)
+{
+}
+
+bool FlashCounterClass::readHeader(uint32_t unit, Header *header)
+{
+  return flash.read(base_address + unit * unit_size, header, sizeof(Header)) &&
+         header->id_hash == variable_hash &&
+         header->checksum == FlashStorageInternal::calcChecksum((const uint8_t *)&header->base, sizeof(uint32_t));
+}
+
+bool FlashCounterClass::isUsedUp(const volatile uint8_t *cell) const
+{
+#if defined(__SAMD51__)
+  // Programmed at all, including a quad-word left half-programmed by a reset
+  return !flash.isErased(cell, CELL_SIZE);
+#else
+  return *(const volatile uint32_t *)cell == 0;
+#endif
+}
+
+void FlashCounterClass::mount()
+{
+  Header header;
+  valid = false;
+  active_unit = 0;
+  base = 0;
+  for (uint32_t unit = 0; unit < 2; unit++) {
+    if (readHeader(unit, &header) && (!valid || header.base > base)) {
+      valid = true;
+      active_unit = unit;
+      base = header.base;
+    }
+  }
+  
+  // Increments use up cells in order, so the used-up cells form a prefix
+  uint32_t lo = 0, hi = cell_count;
+  while (lo < hi) {
+    uint32_t mid = lo + ((hi - lo) >> 1);
+    if (isUsedUp(cell(active_unit, mid))) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cell_index = lo;
+  mounted = true;
+}
+
+bool FlashCounterClass::rollOver(uint32_t new_base)
+{
+  // The other unit only holds an older count, so it can be erased safely
+  uint32_t unit = valid ? (active_unit ^ 1) : 0;
+  const volatile uint8_t *unit_address = base_address + unit * unit_size;
+  
+  Header header = {};
+  header.id_hash = variable_hash;
+  header.base = new_base;
+  header.checksum = FlashStorageInternal::calcChecksum((const uint8_t *)&header.base, sizeof(uint32_t));
+  
+  if (!flash.erase(unit_address, unit_size) || !flash.write(unit_address, &header, sizeof(Header))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+  
+  valid = true;
+  active_unit = unit;
+  base = new_base;
+  cell_index = 0;
+  return true;
+}
+
+bool FlashCounterClass::increment(uint32_t amount)
+{
+  if (!mounted) {
+    mount();
+  }
+  if (!valid && !rollOver(0)) {
+    return false;
+  }
+  
+  while (amount > 0) {
+    if (cell_index >= cell_count) {
+      // Cells used up, carry the total into the other unit's header
+      if (!rollOver(base + capacity())) {
+        return false;
+      }
+      continue;
+    }
+    
+    const volatile uint8_t *cell_ptr = cell(active_unit, cell_index);
+#if defined(__SAMD51__)
+    // Program whole quad-words to zero, one per increment, several per command
+    uint8_t zeros[4 * CELL_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    uint32_t cells = sizeof(zeros) / CELL_SIZE;
+    if (cells > amount) {
+      cells = amount;
+    }
+    if (cells > cell_count - cell_index) {
+      cells = cell_count - cell_index;
+    }
+    
+    if (!flash.write(cell_ptr, zeros, cells * CELL_SIZE)) {
+      mounted = false;
+      return false;
+    }
+    cell_index += cells;
+    amount -= cells;
+#else
+    // Clear the lowest set bits of the current word, one per increment.
+    // A word left half-programmed by a reset still counts its cleared bits.
+    uint32_t word = *(const volatile uint32_t *)cell_ptr;
+    while (amount > 0 && word != 0) {
+      word &= word - 1;
+      amount--;
+    }
+    
+    if (!flash.write(cell_ptr, &word, sizeof(uint32_t))) {
+      mounted = false;
+      return false;
+    }
+    if (word == 0) {
+      cell_index++;
+    }
+#endif
+  }
+  
+  return true;
+}
+
+bool FlashCounterClass::read(uint32_t *value)
+{
+  if (!mounted) {
+    mount();
+  }
+  if (!valid) {
+    return false;  // Never incremented or corrupted
+  }
+  
+  uint32_t count = base + cell_index * COUNTS_PER_CELL;
+#if !defined(__SAMD51__)
+  if (cell_index < cell_count) {
+    count += 32 - __builtin_popcount(*(const volatile uint32_t *)cell(active_unit, cell_index));
+  }
+#endif
+  *value = count;
+  return true;
+}
+
+static const uint16_t GROUP_MAGIC = 0x4753;  // "SG"
+
+FlashStorageGroupClass::FlashStorageGroupClass(const void *flash_addr, uint32_t unit_bytes) :
+  flash(flash_addr, unit_bytes * 2),
+  base_address((const volatile uint8_t *)flash_addr),
+  unit_size(unit_bytes),
+  mounted(false),
+  valid(false),
+  active_unit(0),
+  generation(0),
+  write_offset(0)
+{
+}
+
+// Covers the flags in the length field too
+uint16_t FlashStorageGroupClass::recordChecksum(uint16_t var_hash, const void *data, uint32_t length)
+{
+  using namespace FlashStorageInternal;
+  uint16_t sum = calcChecksum((const uint8_t *)data, length & LENGTH_MASK);
+  sum = hash_combine(sum, var_hash);
+  sum = hash_combine(sum, (uint16_t)length);
+  return hash_combine(sum, (uint16_t)(length >> 16));
+}
+
+bool FlashStorageGroupClass::readUnit(uint32_t unit, uint32_t *unit_generation)
+{
+  UnitHeader header;
+  if (!flash.read(unitAddress(unit), &header, sizeof(UnitHeader)) ||
+      header.magic != GROUP_MAGIC ||
+      header.checksum != FlashStorageInternal::calcChecksum((const uint8_t *)&header.generation, sizeof(uint32_t))) {
+    return false;  // Erased, never written, or interrupted during compaction
+  }
+  *unit_generation = header.generation;
+  return true;
+}
+
+uint8_t FlashStorageGroupClass::readRecord(uint32_t unit, uint32_t offset, RecordHeader *header)
+{
+  if (offset + sizeof(RecordHeader) > unit_size) {
+    return RECORD_END;
+  }
+
+  const volatile uint8_t *record = unitAddress(unit) + offset;
+  if (flash.isErased(record, sizeof(RecordHeader))) {
+    // Blank header ends the unit, unless a reset left record data behind it
+    return flash.isErased(record, unit_size - offset) ? RECORD_END : RECORD_BROKEN;
+  }
+
+  flash.read(record, header, sizeof(RecordHeader));
+  uint32_t length = header->length & LENGTH_MASK;
+  if (length > unit_size || offset + recordSize(length) > unit_size) {
+    return RECORD_BROKEN;  // Length can't be trusted, so the rest of the unit can't be walked
+  }
+  if (header->checksum != recordChecksum(header->id_hash, (const void *)(record + sizeof(RecordHeader)), header->length)) {
+    return RECORD_CORRUPT;
+  }
+  return RECORD_VALID;
+}
+
+void FlashStorageGroupClass::mount()
+{
+  uint32_t found;
+  valid = false;
+  for (uint32_t unit = 0; unit < 2; unit++) {
+    if (readUnit(unit, &found) && (!valid || found > generation)) {
+      valid = true;
+      active_unit = unit;
+      generation = found;
+    }
+  }
+
+  // Records are appended in order, so the first blank header is the end
+  RecordHeader header;
+  uint32_t offset = UNIT_HEADER_SIZE;
+  uint8_t status = RECORD_END;
+  while (valid && ((status = readRecord(active_unit, offset, &header)) == RECORD_VALID || status == RECORD_CORRUPT)) {
+    offset += recordSize(header.length & LENGTH_MASK);
+  }
+  write_offset = (status == RECORD_BROKEN) ? unit_size : offset;  // A broken record fills the unit
+  mounted = true;
+}
+
+// Offset of the newest valid record of a variable in the current unit, 0 if
+// none. Staged records only count once a commit marker pointing at or before
+// them follows; a transaction cut short by a reset has no marker, and the
+// marker of a later transaction points past it.
+uint32_t FlashStorageGroupClass::find(uint16_t var_hash, uint32_t length)
+{
+  RecordHeader header;
+  uint32_t offset = UNIT_HEADER_SIZE, found = 0, staged = 0;
+  uint8_t status;
+  while (offset < write_offset &&
+         ((status = readRecord(active_unit, offset, &header)) == RECORD_VALID || status == RECORD_CORRUPT)) {
+    if (status == RECORD_VALID) {
+      if (header.length & RECORD_COMMIT) {
+        uint32_t start;
+        flash.read(unitAddress(active_unit) + offset + sizeof(RecordHeader), &start, sizeof(uint32_t));
+        if (staged != 0 && staged >= start) {
+          found = staged;
+        }
+        staged = 0;
+      } else if (header.id_hash == var_hash && (header.length & LENGTH_MASK) == length) {
+        if (header.length & RECORD_STAGED) {
+          staged = offset;
+        } else {
+          found = offset;
+        }
+      }
+    }
+    offset += recordSize(header.length & LENGTH_MASK);
+  }
+  return found;
+}
+
+bool FlashStorageGroupClass::isUnchanged(uint16_t var_hash, const void *data, uint32_t length)
+{
+  uint32_t existing = valid ? find(var_hash, length) : 0;
+  return existing != 0 &&
+         memcmp((const void *)(unitAddress(active_unit) + existing + sizeof(RecordHeader)), data, length) == 0;
+}
+
+// Copy the newest record of every variable into the other unit, then commit
+// it by writing its header. The other unit only holds older copies.
+bool FlashStorageGroupClass::compact()
+{
+  uint32_t target = valid ? (active_unit ^ 1) : 0;
+  const volatile uint8_t *dst = unitAddress(target);
+  if (!flash.erase(dst, unit_size)) {
+    mounted = false;
+    return false;
+  }
+
+  uint32_t out = UNIT_HEADER_SIZE;
+  RecordHeader header;
+  uint32_t offset = UNIT_HEADER_SIZE;
+  uint8_t status;
+  while (valid && offset < write_offset &&
+         ((status = readRecord(active_unit, offset, &header)) == RECORD_VALID || status == RECORD_CORRUPT)) {
+    uint32_t length = header.length & LENGTH_MASK;
+    uint32_t size = recordSize(length);
+    const volatile uint8_t *src = unitAddress(active_unit) + offset;
+    if (status == RECORD_VALID && !(header.length & RECORD_COMMIT) && find(header.id_hash, length) == offset) {
+      bool ok;
+      if (header.length & RECORD_STAGED) {
+        // Committed, so it moves over as a plain record, its header
+        // programmed together with the start of the data
+        header.length = length;
+        header.checksum = recordChecksum(header.id_hash, (const void *)(src + sizeof(RecordHeader)), length);
+        FlashPart parts[] = {
+          { 0, &header, sizeof(RecordHeader) },
+          { sizeof(RecordHeader), src + sizeof(RecordHeader), length },
+        };
+        ok = flash.writeParts(dst + out, size, parts, 2, sizeof(RecordHeader));
+      } else {
+        ok = flash.write(dst + out, (const void *)src, size);
+      }
+      if (!ok) {
+        mounted = false;
+        return false;
+      }
+      out += size;
+    }
+    offset += size;
+  }
+
+  UnitHeader unit_header;
+  unit_header.magic = GROUP_MAGIC;
+  unit_header.generation = valid ? generation + 1 : 0;
+  unit_header.checksum = FlashStorageInternal::calcChecksum((const uint8_t *)&unit_header.generation, sizeof(uint32_t));
+  if (!flash.write(dst, &unit_header, sizeof(UnitHeader))) {
+    mounted = false;
+    return false;
+  }
+
+  valid = true;
+  active_unit = target;
+  generation = unit_header.generation;
+  write_offset = out;
+  return true;
+}
+
+// Start the first unit, or move the current values over once this one can't
+// take size more bytes
+bool FlashStorageGroupClass::makeRoom(uint32_t size)
+{
+  if (size > unit_size - UNIT_HEADER_SIZE) {
+    return false;
+  }
+  if ((!valid || write_offset + size > unit_size) && !compact()) {
+    return false;
+  }
+  return write_offset + size <= unit_size;  // Otherwise the newest values of all variables fill the unit
+}
+
+bool FlashStorageGroupClass::append(uint16_t var_hash, const void *data, uint32_t length, uint32_t flags)
+{
+  RecordHeader header;
+  header.id_hash = var_hash;
+  header.length = length | flags;
+  header.checksum = recordChecksum(var_hash, data, header.length);
+
+  // The header goes last, so a record only shows up once it is complete.
+  // It shares its granule with the start of the data, which is programmed
+  // with it in one go.
+  const volatile uint8_t *record = unitAddress(active_unit) + write_offset;
+  FlashPart parts[] = {
+    { 0, &header, sizeof(RecordHeader) },
+    { sizeof(RecordHeader), data, length },
+  };
+  if (!flash.writeParts(record, recordSize(length), parts, 2, sizeof(RecordHeader))) {
+    mounted = false;  // Flash state unknown, rescan on next access
+    return false;
+  }
+  write_offset += recordSize(length);
+  return true;
+}
+
+bool FlashStorageGroupClass::write(uint16_t var_hash, const void *data, uint32_t length)
+{
+  if (!mounted) {
+    mount();
+  }
+  if (isUnchanged(var_hash, data, length)) {
+    return true;  // Data unchanged, skip write to preserve flash endurance
+  }
+  return makeRoom(recordSize(length)) && append(var_hash, data, length, 0);
+}
+
+bool FlashStorageGroupClass::read(uint16_t var_hash, void *data, uint32_t length)
+{
+  if (!mounted) {
+    mount();
+  }
+  if (!valid) {
+    return false;  // Never written
+  }
+
+  uint32_t offset = find(var_hash, length);
+  if (offset == 0) {
+    return false;  // Never written, structure size changed or corrupted
+  }
+  return flash.read(unitAddress(active_unit) + offset + sizeof(RecordHeader), data, length);
+}
+
+// Room for every changed record and the marker is made first, so a commit
+// erases at most once and its records are never split across units
+bool FlashStorageGroupClass::commit(const FlashTxn &txn)
+{
+  if (!mounted) {
+    mount();
+  }
+
+  bool changed[FLASHTXN_MAX_RECORDS];
+  uint32_t size = 0, changes = 0, last = 0;
+  for (uint32_t i = 0; i < txn.count; i++) {
+    const FlashTxn::Entry &entry = txn.entries[i];
+    changed[i] = !isUnchanged(entry.var_hash, txn.buffer + entry.offset, entry.length);
+    if (changed[i]) {
+      size += recordSize(entry.length);
+      changes++;
+      last = i;
+    }
+  }
+  if (changes == 0) {
+    return true;
+  }
+  if (changes == 1) {
+    // A single record is all-or-nothing by itself
+    const FlashTxn::Entry &entry = txn.entries[last];
+    return makeRoom(size) && append(entry.var_hash, txn.buffer + entry.offset, entry.length, 0);
+  }
+
+  if (!makeRoom(size + recordSize(sizeof(uint32_t)))) {
+    return false;
+  }
+  uint32_t start = write_offset;
+  for (uint32_t i = 0; i < txn.count; i++) {
+    const FlashTxn::Entry &entry = txn.entries[i];
+    if (changed[i] && !append(entry.var_hash, txn.buffer + entry.offset, entry.length, RECORD_STAGED)) {
+      return false;
+    }
+  }
+  return append(0, &start, sizeof(uint32_t), RECORD_COMMIT);
+}
+
+bool FlashTxn::stage(FlashStorageGroupClass &member_group, uint16_t var_hash, const void *data, uint32_t length)
+{
+  if (group != NULL && group != &member_group) {
+    failed = true;  // All members of a transaction must share one group
+    return false;
+  }
+  group = &member_group;
+
+  // Staging a member again replaces its value
+  for (uint32_t i = 0; i < count; i++) {
+    if (entries[i].var_hash == var_hash && entries[i].length == length) {
+      memcpy(buffer + entries[i].offset, data, length);
+      return true;
+    }
+  }
+
+  if (count >= FLASHTXN_MAX_RECORDS || used + length > FLASHTXN_MAX_BYTES) {
+    failed = true;
+    return false;
+  }
+  entries[count].var_hash = var_hash;
+  entries[count].offset = used;
+  entries[count].length = (uint16_t)length;
+  memcpy(buffer + used, data, length);
+  used += length;
+  count++;
+  return true;
+}
+
+bool FlashTxn::commit()
+{
+  bool ok = !failed && (group == NULL || group->commit(*this));
+  clear();
+  return ok;
+}
+
+void FlashTxn::clear()
+{
+  group = NULL;
+  count = 0;
+  used = 0;
+  failed = false;
+}
+
+#if defined(__SAMD51__)
+SmartEEPROMClass::SmartEEPROMClass(uint32_t offset, uint32_t size) :
+  offset(offset),
+  size(size)
+{
+}
+
+uint32_t SmartEEPROMClass::capacity()
+{
+  // Virtual size is 512 bytes << PSZ, limited by the number of blocks (SBLK)
+  // reserved for SmartEEPROM, see the SAMD51 datasheet SmartEEPROM size table
+  uint32_t sblk = NVMCTRL->SEESTAT.bit.SBLK;
+  if (sblk == 0) {
+    return 0;  // SmartEEPROM disabled by fuses
+  }
+  
+  uint32_t max_size;
+  if (sblk == 1) {
+    max_size = 4096;
+  } else if (sblk == 2) {
+    max_size = 8192;
+  } else if (sblk <= 4) {
+    max_size = 16384;
+  } else if (sblk <= 8) {
+    max_size = 32768;
+  } else {
+    max_size = 65536;
+  }
+  
+  uint32_t psz_size = 512UL << NVMCTRL->SEESTAT.bit.PSZ;
+  return (psz_size < max_size) ? psz_size : max_size;
+}
+
+bool SmartEEPROMClass::isAvailable() const
+{
+  uint32_t total = capacity();
+  return size <= total && offset <= total - size;
+}
+
+void SmartEEPROMClass::waitReady()
+{
+  while (NVMCTRL->SEESTAT.bit.BUSY) { }
+}
+
+bool SmartEEPROMClass::write(uint32_t pos, const void *data, uint32_t n)
+{
+  if (!isAvailable() || pos > size || n > size - pos ||
+      NVMCTRL->SEESTAT.bit.LOCK || NVMCTRL->SEESTAT.bit.RLOCK) {
+    return false;
+  }
+  
+  const uint8_t *src = (const uint8_t *)data;
+  volatile uint8_t *dst = (volatile uint8_t *)address() + pos;
+  
+  waitReady();
+  for (uint32_t i = 0; i < n; i++) {
+    if (dst[i] == src[i]) {
+      continue;  // Unchanged bytes cost nothing
+    }
+    waitReady();
+    dst[i] = src[i];
+  }
+  
+  waitReady();
+  
+  // Memory barrier to ensure SmartEEPROM write completion before subsequent reads
+  __DSB();
+  
+  return true;
+}
+
+bool SmartEEPROMClass::read(void *data) const
+{
+  if (!isAvailable()) {
+    return false;
+  }
+  
+  waitReady();
+  memcpy(data, (const void *)address(), size);
+  
+  return true;
+}
+#endif
@@ -23,12 +23,13 @@
 #pragma once
 
 #include <Arduino.h>
+#include <stddef.h>
 
 // Concatenate after macro expansion (namespaced to avoid conflicts)
 #define FLASHSTORAGE_PPCAT_NX(A, B) A ## B
 #define FLASHSTORAGE_PPCAT(A, B) FLASHSTORAGE_PPCAT_NX(A, B)
 
-// Compile-time string hash for variable identification
+// Compile-time string hash for variable identification, plus record checksum
 namespace FlashStorageInternal {
   constexpr uint16_t hash_combine(uint16_t hash, uint16_t value) {
     return hash ^ (value + 0x9e37 + (hash << 6) + (hash >> 2));
@@ -42,9 +43,105 @@ namespace FlashStorageInternal {
   constexpr uint16_t hash_variable(const char* name, size_t size) {
     return hash_combine(hash_string(name), (uint16_t)size);
   }
+
+  // Calculate checksum for data validation
+  // Optimized to process 32-bit words for better performance on ARM Cortex-M
+  inline uint16_t calcChecksum(const uint8_t* ptr, size_t len) {
+    uint32_t sum = 0xA5A5A5A5;  // 32-bit seed for better mixing
+    
+    // Process full 32-bit words for efficiency
+    size_t words = len >> 2;  // len / 4
+    const uint32_t* ptr32 = (const uint32_t*)ptr;
+    for (size_t i = 0; i < words; i++) {
+      uint32_t word;
+      // Use memcpy to avoid unaligned access issues
+      memcpy(&word, &ptr32[i], sizeof(uint32_t));
+      sum += word;
+      sum ^= (sum >> 16);  // Mix upper and lower halves
+    }
+    
+    // Process remaining bytes
+    size_t remaining = len & 3;  // len % 4
+    const uint8_t* ptr8 = ptr + (words << 2);
+    for (size_t i = 0; i < remaining; i++) {
+      sum += ptr8[i];
+      sum ^= (sum >> 8);
+    }
+    
+    // Fold 32-bit sum down to 16-bit
+    return (uint16_t)(sum ^ (sum >> 16));
+  }
+
+  // 32-bit fingerprint, independent of calcChecksum, for telling values
+  // apart in RAM without reading flash
+  inline uint32_t calcFingerprint(const uint8_t* ptr, size_t len) {
+    uint32_t hash = 0x811C9DC5 ^ (uint32_t)len;
+    
+    size_t words = len >> 2;
+    for (size_t i = 0; i < words; i++) {
+      uint32_t word;
+      memcpy(&word, ptr + (i << 2), sizeof(uint32_t));
+      hash ^= word * 0xCC9E2D51;
+      hash = ((hash << 13) | (hash >> 19)) * 5 + 0xE6546B64;
+    }
+    
+    const uint8_t* ptr8 = ptr + (words << 2);
+    for (size_t i = 0; i < (len & 3); i++) {
+      hash ^= ptr8[i] * 0xCC9E2D51;
+      hash = ((hash << 13) | (hash >> 19)) * 5 + 0xE6546B64;
+    }
+    
+    // Final mix so every input bit affects every output bit
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    return hash ^ (hash >> 16);
+  }
+
+  // Validated record used by FlashStorageClass and SmartEEPROMStorageClass,
+  // built and checked a piece at a time in place so T is never copied whole
+  template<class T>
+  struct Record {
+    struct Format {
+      uint16_t id_hash;  // Hash of variable name + sizeof(T)
+      T data;
+      uint16_t checksum;
+    };
+    
+    static const uint32_t DATA_OFFSET = offsetof(Format, data);
+    static const uint32_t CHECKSUM_OFFSET = offsetof(Format, checksum);
+    
+    // True if the record at the address belongs to var_hash and its checksum matches
+    static bool isValid(const volatile uint8_t *record, uint16_t var_hash) {
+      return *(const volatile uint16_t *)record == var_hash &&
+             *(const volatile uint16_t *)(record + CHECKSUM_OFFSET) ==
+               calcChecksum((const uint8_t *)(record + DATA_OFFSET), sizeof(T));
+    }
+    
+    // Bytes pos..pos+n-1 of the record for data, with zeroed padding
+    static void fill(uint8_t *chunk, uint32_t pos, uint32_t n, uint16_t var_hash, const T &data, uint16_t checksum) {
+      memset(chunk, 0, n);
+      copyField(chunk, pos, n, 0, &var_hash, sizeof(uint16_t));
+      copyField(chunk, pos, n, DATA_OFFSET, &data, sizeof(T));
+      copyField(chunk, pos, n, CHECKSUM_OFFSET, &checksum, sizeof(uint16_t));
+    }
+    
+    static void copyField(uint8_t *chunk, uint32_t pos, uint32_t n, uint32_t offset, const void *field, uint32_t size) {
+      uint32_t from = offset > pos ? offset : pos;
+      uint32_t to = (offset + size < pos + n) ? offset + size : pos + n;
+      if (from < to) {
+        memcpy(chunk + (from - pos), (const uint8_t *)field + (from - offset), to - from);
+      }
+    }
+  };
 }
 
 #if defined(__SAMD51__)
+  // SAMD51 programs the main array in 128-bit quad-words, 512-byte pages
+  #define FLASHSTORAGE_WRITE_GRANULE 16
+  #define FLASHSTORAGE_PAGE_BYTES 512
+
   #define Flash(name, size) \
   __attribute__((__aligned__(8192))) \
   static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(size+8191)/8192*8192] = { }; \
@@ -53,8 +150,59 @@ namespace FlashStorageInternal {
 #define FlashStorage(name, T) \
   __attribute__((__aligned__(8192))) \
   static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(sizeof(T)+4+8191)/8192*8192] = { }; \
-  FlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)));
+  FlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                            sizeof(FLASHSTORAGE_PPCAT(_data,name)));
+
+// FlashStorage plus a RAM copy of the value, sizeof(T) bytes of RAM
+#define CachedFlashStorage(name, T) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(sizeof(T)+4+8191)/8192*8192] = { }; \
+  CachedFlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                  sizeof(FLASHSTORAGE_PPCAT(_data,name)));
+
+// Rotate records across 'units' erase blocks to spread wear
+#define FlashStorageRing(name, T, units) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*((sizeof(T)+8+8191)/8192*8192)] = { }; \
+  FlashStorageRingClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                (sizeof(T)+8+8191)/8192*8192, units);
+
+// A/B storage in two blocks: one holds the current value while the standby one
+// is erased in the background (flashIdle()), so a write never erases first
+#define FlashStorageAB(name, T) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*((sizeof(T)+8+8191)/8192*8192)] = { }; \
+  FlashStorageRingClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                (sizeof(T)+8+8191)/8192*8192, 2, 1);
+
+// Place storage in the flash bank the sketch does not run from, 'block' 8KB
+// blocks below the end of that bank (or below the SmartEEPROM blocks at the
+// end of the array), so erases and writes don't stall the CPU
+#define FlashStorageOtherBank(name, T, block) \
+  FlashStorageClass<T> name(FlashClass::otherBankAddress((block) * 8192, (sizeof(T)+4+8191)/8192*8192), \
+                            FlashStorageInternal::hash_variable(#name, sizeof(T)), (sizeof(T)+4+8191)/8192*8192);
+
+// Monotonic counter in two 8KB blocks, one quad-word program per increment
+#define FlashCounter(name) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*8192] = { }; \
+  FlashCounterClass name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(uint32_t)), 8192);
+
+// Variables sharing two 8KB blocks, each with room for 'size' bytes of records.
+// Declare the variables with FlashStorageMember().
+#define FlashStorageGroup(name, size) \
+  __attribute__((__aligned__(8192))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*(((size)+8191)/8192*8192)] = { }; \
+  FlashStorageGroupClass name(FLASHSTORAGE_PPCAT(_data,name), ((size)+8191)/8192*8192);
+
+// Store in hardware SmartEEPROM at a fixed byte offset (requires SBLK/PSZ fuses)
+#define FlashStorageSmartEEPROM(name, T, offset) \
+  SmartEEPROMStorageClass<T> name(offset, FlashStorageInternal::hash_variable(#name, sizeof(T)));
 #else
+  // SAMD21 page buffer is loaded in 32-bit words, 64-byte pages
+  #define FLASHSTORAGE_WRITE_GRANULE 4
+  #define FLASHSTORAGE_PAGE_BYTES 64
+
   // SAMD21: All variants have 64-byte pages, so ROW_SIZE = 256 bytes (64 * 4)
   #define Flash(name, size) \
   __attribute__((__aligned__(256))) \
@@ -64,13 +212,84 @@ namespace FlashStorageInternal {
 #define FlashStorage(name, T) \
   __attribute__((__aligned__(256))) \
   static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(sizeof(T)+4+255)/256*256] = { }; \
-  FlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)));
+  FlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                            sizeof(FLASHSTORAGE_PPCAT(_data,name)));
+
+// FlashStorage plus a RAM copy of the value, sizeof(T) bytes of RAM
+#define CachedFlashStorage(name, T) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(sizeof(T)+4+255)/256*256] = { }; \
+  CachedFlashStorageClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                  sizeof(FLASHSTORAGE_PPCAT(_data,name)));
+
+// Rotate records across 'units' rows to spread wear
+#define FlashStorageRing(name, T, units) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[(units)*((sizeof(T)+8+255)/256*256)] = { }; \
+  FlashStorageRingClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                (sizeof(T)+8+255)/256*256, units);
+
+// A/B storage in two rows: one holds the current value while the standby one
+// is erased in the background (flashIdle()), so a write never erases first
+#define FlashStorageAB(name, T) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*((sizeof(T)+8+255)/256*256)] = { }; \
+  FlashStorageRingClass<T> name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(T)), \
+                                (sizeof(T)+8+255)/256*256, 2, 1);
+
+// Monotonic counter in two rows, one word program per increment
+#define FlashCounter(name) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*256] = { }; \
+  FlashCounterClass name(FLASHSTORAGE_PPCAT(_data,name), FlashStorageInternal::hash_variable(#name, sizeof(uint32_t)), 256);
+
+// Variables sharing two row-aligned units, each with room for 'size' bytes of
+// records. Declare the variables with FlashStorageMember().
+#define FlashStorageGroup(name, size) \
+  __attribute__((__aligned__(256))) \
+  static const uint8_t FLASHSTORAGE_PPCAT(_data,name)[2*(((size)+255)/256*256)] = { }; \
+  FlashStorageGroupClass name(FLASHSTORAGE_PPCAT(_data,name), ((size)+255)/256*256);
+
+#if defined(NVMCTRL_RWW_EEPROM_ADDR)
+// Place storage in the RWWEE array, 'row' 256-byte rows from its start. Parts
+// whose headers define the array are checked for it when the sketch starts;
+// without it, or if the row does not fit, read() and write() return false.
+#define FlashStorageRWWEE(name, T, row) \
+  FlashStorageClass<T> name(FlashClass::rwweeAddress((row) * 256, (sizeof(T)+4+255)/256*256, NULL), \
+                            FlashStorageInternal::hash_variable(#name, sizeof(T)), (sizeof(T)+4+255)/256*256);
+#else
+// No RWWEE array on this part: a normal main-flash row
+#define FlashStorageRWWEE(name, T, row) FlashStorage(name, T)
 #endif
+#endif
+
+// Variable stored in a FlashStorageGroup instead of its own erase unit
+#define FlashStorageMember(group, name, T) \
+  FlashStorageMemberClass<T> name(group, FlashStorageInternal::hash_variable(#name, sizeof(T)));
+
+// Define FLASHSTORAGE_RAMFUNC in the build flags (it must reach the library's
+// .cpp, not just the sketch) to run NVM command/wait sequences from SRAM.
+// .data.* sections are copied to SRAM by the core's startup code. A core
+// with its own RAM code section can define FLASHSTORAGE_RAMFUNC_ATTR too.
+#if defined(FLASHSTORAGE_RAMFUNC) && !defined(FLASHSTORAGE_RAMFUNC_ATTR)
+  #define FLASHSTORAGE_RAMFUNC_ATTR __attribute__((section(".data.ramfunc"), noinline, long_call))
+#endif
+
+// Called once a non-blocking FlashClass operation has completed
+typedef void (*FlashCallback)(void *context);
+
+// One field of a record assembled by FlashClass::writeParts()
+struct FlashPart {
+  uint32_t offset;            // Position in the record
+  const volatile void *data;  // RAM or flash
+  uint32_t size;
+};
 
 // WARNING: FlashClass operations are NOT interrupt-safe and NOT thread-safe.
 // - Do not call from interrupt service routines (ISRs)
 // - Do not call concurrently from multiple threads/contexts
 // - Flash operations can take milliseconds and block execution
+//   (use beginWrite()/beginErase() + poll() to avoid blocking)
 class FlashClass {
 public:
   FlashClass(const void *flash_addr = NULL, uint32_t size = 0);
@@ -79,103 +298,742 @@ public:
   bool erase()                 { return erase(flash_address, flash_size);       }
   bool read(void *data)        { return read(flash_address, data, flash_size);  }
 
+  // Blocking write/erase. A non-blocking operation still in flight on any
+  // instance is finished first, and its callback runs before these return.
   bool write(const volatile void *flash_ptr, const void *data, uint32_t size);
   bool erase(const volatile void *flash_ptr, uint32_t size);
   bool read(const volatile void *flash_ptr, void *data, uint32_t size);
 
+  // Returns true if every byte in the range reads back as 0xFF (erased state).
+  bool isErased(const volatile void *flash_ptr, uint32_t size) const;
+
+  // Program data over the current contents without erasing. Flash can only
+  // clear bits, so this fails (and writes nothing) if any bit would have to go
+  // from 0 to 1. Only the runs of write granules that change are programmed.
+  // SAMD51 also programs each 16-byte ECC quad-word only once per erase, so
+  // there every quad-word that changes must still be blank (all 0xFF).
+  // There is no second copy: a reset part-way leaves the range with some
+  // granules updated and others not.
+  bool overwrite(const volatile void *flash_ptr, const void *data, uint32_t size);
+
+  // Returns true if overwrite() would accept data over the range
+  bool canOverwrite(const volatile void *flash_ptr, const void *data, uint32_t size) const;
+
+  // Program a size-byte record into blank flash, assembled a page at a time
+  // from parts; bytes no part covers stay 0xFF. The first head bytes (rounded
+  // up to the program granule) go last in one program, so a record with its
+  // header there only becomes visible once complete, and no granule is
+  // programmed twice.
+  bool writeParts(const volatile void *flash_ptr, uint32_t size, const FlashPart *parts, uint32_t count,
+                  uint32_t head);
+
+  // Non-blocking write/erase. Each call issues the first page program or row
+  // erase and returns immediately; poll() issues the rest one command at a time.
+  // Returns false if the range is invalid or another operation is in flight.
+  // The data buffer must stay valid until the operation completes.
+  // Note: the CPU still stalls if it fetches code or data from the same flash
+  // array while a command is running.
+  bool beginWrite(const void *data, FlashCallback callback = NULL, void *context = NULL) {
+    return beginWrite(flash_address, data, flash_size, callback, context);
+  }
+  bool beginErase(FlashCallback callback = NULL, void *context = NULL) {
+    return beginErase(flash_address, flash_size, callback, context);
+  }
+  bool beginWrite(const volatile void *flash_ptr, const void *data, uint32_t size,
+                  FlashCallback callback = NULL, void *context = NULL);
+  bool beginErase(const volatile void *flash_ptr, uint32_t size,
+                  FlashCallback callback = NULL, void *context = NULL);
+
+  // Advance a non-blocking operation. Call from loop() until it returns false.
+  // Returns true while the operation is still running.
+  bool poll();
+  bool isBusy() const { return op != OP_NONE; }
+
+  // Advance non-blocking operations from the NVMCTRL interrupt instead of loop().
+  // The sketch must call FlashClass::handleInterrupt() from NVMCTRL_Handler
+  // (NVMCTRL_0_Handler on SAMD51).
+  static void useInterrupt(bool enable);
+  static void handleInterrupt();
+
+  // Bound how long blocking write()/erase() keep interrupts disabled. Interrupts
+  // are re-enabled between page programs and row erases whenever the next
+  // command could run past the limit. A single command is never split, so the
+  // effective minimum is one page program or row erase. 0 (the default) keeps
+  // interrupts disabled for the whole operation.
+  static void setMaxCriticalSection(uint32_t us);
+
+#if defined(FLASHSTORAGE_RAMFUNC)
+  // Keep this interrupt enabled while blocking operations wait on the NVM
+  // controller. Its handler must run from SRAM (FLASHSTORAGE_RAMFUNC_ATTR) and
+  // relocateVectorTable() must have been called, otherwise the CPU stalls
+  // fetching the vector or handler until the command completes.
+  static void allowDuringFlash(IRQn_Type irq);
+
+  // Copy the interrupt vector table to SRAM and point VTOR at it
+  static void relocateVectorTable();
+#endif
+
+  // Longest interrupts-off window observed in blocking operations, in
+  // microseconds. Windows are only timed while setMaxCriticalSection() has a
+  // limit set; without one this stays 0.
+  static uint32_t maxInterruptsOff();
+  static void resetInterruptsOffStats();
+
+  // Returns true if this region can be written while code keeps running: the
+  // flash bank the running code does not execute from (SAMD51) or the RWWEE
+  // array (SAMD21). Blocking operations on such a region keep interrupts
+  // enabled while each command runs, and non-blocking ones never stall the CPU.
+  bool isReadWhileWrite() const;
+
+#if !defined(__SAMD51__)
+  // Address offset bytes into the SAMD21 RWWEE array, or fallback if this part
+  // has no RWWEE array or the row-aligned region would not fit in it.
+  static const void *rwweeAddress(uint32_t offset, uint32_t size, const void *fallback);
+#endif
+
+#if defined(__SAMD51__)
+
+  // Address of a size-byte region ending offset bytes below the end of the bank
+  // the running code does not execute from, below any SmartEEPROM blocks that
+  // the SBLK fuse reserves at the end of the array. Returns NULL if the region
+  // would not be block-aligned, would not fit, or would overlap the program image.
+  static const void *otherBankAddress(uint32_t offset, uint32_t size);
+#endif
+
 private:
+  enum { OP_NONE, OP_WRITE, OP_ERASE };
+
   bool isWithinBounds(const volatile void *flash_ptr, uint32_t size) const;
-  bool erase(const volatile void *flash_ptr);
+  bool isRowErasable(const volatile void *flash_ptr) const;
+
+  // Command sequencing shared by blocking and non-blocking operations
+  void startOperation(uint8_t kind, const volatile void *flash_ptr, const void *data, uint32_t size);
+  bool skipErasedRow();
+  uint32_t prepareStep();
+  void issueStep();
+  static bool enterBlocking();
+  void runBlocking();
+  void finishOperation();
+  static void setCompletionInterrupt(bool enable);
 
   const uint32_t PAGE_SIZE, ROW_SIZE;
   const volatile void *flash_address;
   const uint32_t flash_size;
+
+  // State of the operation in flight
+  volatile uint8_t op;
+  const volatile uint8_t *op_ptr;
+  const uint8_t *op_src;
+  uint32_t op_remaining;
+  uint8_t op_tail;
+  FlashCallback op_callback;
+  void *op_context;
+  bool op_rww;  // Target can be written while code keeps running
+  bool op_blocking;  // Started by write()/erase() rather than beginWrite()/beginErase()
+#if defined(__SAMD51__)
+  bool op_cachedis0, op_cachedis1;
+#endif
+
+  static FlashClass * volatile active;
+  static bool interrupt_driven;
 };
 
 template<class T>
 class FlashStorageClass {
+private:
+  typedef FlashStorageInternal::Record<T> Record;
+  typedef typename Record::Format StorageFormat;
+  
+  FlashClass flash;
+  uint16_t variable_hash;
+  
+  // Records are appended into fixed-size slots across the whole erase unit.
+  // Slots are rounded up to the program granule so each one can be written
+  // without disturbing its neighbours.
+  static const uint32_t SLOT_SIZE =
+    (sizeof(StorageFormat) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+
+  const volatile uint8_t *slot(uint32_t index) const {
+    return slots + index * SLOT_SIZE;
+  }
+
+  // Number of slots in use. Slots are filled in order, so the used slots
+  // always form a prefix of the region and can be found by binary search.
+  uint32_t usedSlots() {
+    uint32_t lo = 0, hi = slot_count;
+    while (lo < hi) {
+      uint32_t mid = lo + ((hi - lo) >> 1);
+      if (flash.isErased(slot(mid), SLOT_SIZE)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  static const uint32_t DATA_OFFSET = Record::DATA_OFFSET;
+  static const uint32_t CHECKSUM_OFFSET = Record::CHECKSUM_OFFSET;
+
+  // Index of the newest valid record at or below used-1, validated in place
+  // in flash. Slots left behind by an interrupted write fail validation and
+  // are skipped.
+  bool findNewest(uint32_t used, uint32_t *index) {
+    while (used > 0) {
+      used--;
+      if (Record::isValid(slot(used), variable_hash)) {
+        *index = used;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Newest valid record. Flash only changes through write(), so it is
+  // validated once and remembered until then.
+  bool newestSlot(uint32_t *index) {
+    if (!validated) {
+      validated = findNewest(usedSlots(), &validated_slot);
+    }
+    *index = validated_slot;
+    return validated;
+  }
+
+  void remember(uint16_t checksum, uint32_t fingerprint) {
+    fingerprinted = true;
+    last_checksum = checksum;
+    last_fingerprint = fingerprint;
+  }
+
+  // Program the record for data one flash page at a time, so only a page of
+  // RAM is needed whatever sizeof(T) is
+  bool writeRecord(const volatile uint8_t *dst, const T &data, uint16_t checksum) {
+    uint8_t chunk[FLASHSTORAGE_PAGE_BYTES];
+    for (uint32_t pos = 0, n; pos < sizeof(StorageFormat); pos += n) {
+      n = chunkSize(dst, pos);
+      Record::fill(chunk, pos, n, variable_hash, data, checksum);
+      if (!flash.write(dst + pos, chunk, n)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Record bytes from pos up to the next page boundary
+  static uint32_t chunkSize(const volatile uint8_t *dst, uint32_t pos) {
+    uint32_t n = FLASHSTORAGE_PAGE_BYTES - ((uintptr_t)(dst + pos) & (FLASHSTORAGE_PAGE_BYTES - 1));
+    return (sizeof(StorageFormat) - pos < n) ? sizeof(StorageFormat) - pos : n;
+  }
+
+  const volatile uint8_t *slots;
+  uint32_t slot_count;
+
+  // Found by newestSlot() and cleared by write()
+  bool validated;
+  uint32_t validated_slot;
+
+  // Checksum and fingerprint of the value last written, or found unchanged
+  bool fingerprinted;
+  uint16_t last_checksum;
+  uint32_t last_fingerprint;
+
+public:
+  // region_size is the number of bytes reserved at flash_addr (the FlashStorage
+  // macro passes the full erase unit). A region_size of 0 reserves one slot.
+  FlashStorageClass(const void *flash_addr, uint16_t var_hash, uint32_t region_size = 0)
+    : flash(flash_addr, region_size >= SLOT_SIZE ? region_size : SLOT_SIZE), variable_hash(var_hash),
+      slots((const volatile uint8_t *)flash_addr),
+      slot_count(region_size >= SLOT_SIZE ? region_size / SLOT_SIZE : 1),
+      validated(false), validated_slot(0),
+      fingerprinted(false), last_checksum(0), last_fingerprint(0) { };
+
+  // Write data into flash memory with checksum validation.
+  // Returns true on success, false on error.
+  // Optimization: Skips erase+write if data hasn't changed (preserves flash endurance).
+  // Optimization: Appends into the next blank slot of the erase unit, so an
+  // erase is only needed once every slot has been used.
+  // The record is streamed out a page at a time, so a write needs about one
+  // flash page of stack for any T. Unchanged values are recognised from a
+  // checksum and fingerprint kept in RAM, or by comparing with flash in
+  // place for the first write after reset.
+  inline bool write(const T &data) {
+    if (slots == NULL) {
+      return false;  // No flash region could be placed for this variable
+    }
+    
+    uint16_t checksum = FlashStorageInternal::calcChecksum((const uint8_t*)&data, sizeof(T));
+    uint32_t fingerprint = FlashStorageInternal::calcFingerprint((const uint8_t*)&data, sizeof(T));
+    
+    // This instance wrote the newest record itself, so its checksum and
+    // fingerprint in RAM tell whether the new value differs without reading
+    // flash. Only before that (after reset) is the newest record compared.
+    if (fingerprinted && checksum == last_checksum && fingerprint == last_fingerprint) {
+      return true;  // Data unchanged, skip erase+write to preserve flash endurance
+    }
+    uint32_t newest = 0;
+    if (!fingerprinted && newestSlot(&newest) && *(const volatile uint16_t *)(slot(newest) + CHECKSUM_OFFSET) == checksum &&
+        memcmp((const void *)(slot(newest) + DATA_OFFSET), &data, sizeof(T)) == 0) {
+      remember(checksum, fingerprint);
+      return true;  // Data unchanged, skip erase+write to preserve flash endurance
+    }
+    validated = false;  // Revalidated by the next read
+    fingerprinted = false;
+    
+    uint32_t used = usedSlots();
+    
+    // Data changed or uninitialized, append into the next blank slot
+    // (the previous record stays intact until the new one is complete)
+    bool written;
+    if (used < slot_count) {
+      written = writeRecord(slot(used), data, checksum);
+    } else {
+      // Erase unit is full, start over from the first slot
+      written = flash.erase() && writeRecord(slot(0), data, checksum);
+    }
+    if (written) {
+      remember(checksum, fingerprint);
+    }
+    return written;
+  }
+
+  // Read data from flash into variable with validation.
+  // Returns the newest valid record if found, false if uninitialized or corrupted.
+  // Only the first read after a write() validates; later ones just copy.
+  inline bool read(T *data) {
+    uint32_t newest;
+    if (slots == NULL || !newestSlot(&newest)) {
+      return false;  // Wrong variable, structure size changed, uninitialized or corrupted
+    }
+    
+    return flash.read(slot(newest) + DATA_OFFSET, data, sizeof(T));
+  }
+
+  // Overloaded version of read.
+  // Returns default-constructed T if validation fails.
+  // Check return value of read(T*) version for explicit validation.
+  inline T read() { T data; read(&data); return data; }
+
+  // Validate the newest record and point straight at its data in flash, so
+  // large read-mostly tables (lookup curves, fonts, calibration) need no RAM
+  // and no copy. Returns NULL if uninitialized or corrupted. The pointer
+  // stays valid until the next write(), which may move or erase the record.
+  // Validation is remembered as in read(), so repeated calls are cheap.
+  inline const T *view() {
+    uint32_t newest;
+    if (slots == NULL || !newestSlot(&newest)) {
+      return NULL;
+    }
+    return (const T *)(slot(newest) + DATA_OFFSET);
+  }
+
+  // Reference version of view().
+  // Refers to a default-constructed T if validation fails.
+  inline const T &ref() {
+    static const T empty = T();
+    const T *data = view();
+    return data ? *data : empty;
+  }
+
+  // Forget the validated record and the checksum and fingerprint of the last
+  // write, after the region was erased or written by other means. The next
+  // read() validates again and the next write() compares with flash.
+  inline void invalidate() { validated = false; fingerprinted = false; }
+};
+
+// FlashStorageClass with a RAM copy of the value, for read-mostly settings
+// on hot paths. The first access validates the record in flash and keeps a
+// copy, and later reads are served from RAM. write() goes through to flash
+// only if the value differs from the copy. Costs sizeof(T) bytes of RAM per
+// instance on top of FlashStorageClass, so use it only where it pays off.
+template<class T>
+class CachedFlashStorageClass {
+public:
+  CachedFlashStorageClass(const void *flash_addr, uint16_t var_hash, uint32_t region_size = 0)
+    : storage(flash_addr, var_hash, region_size), loaded(false), present(false) { }
+
+  // Write data through to flash and update the RAM copy.
+  // Returns true on success, false on error.
+  // Optimization: Skips the flash write if data equals the RAM copy.
+  inline bool write(const T &data) {
+    load();
+    if (present && memcmp(&cache, &data, sizeof(T)) == 0) {
+      return true;  // Data unchanged, skip write to preserve flash endurance
+    }
+    if (!storage.write(data)) {
+      loaded = false;  // Flash state unknown, reload on next access
+      return false;
+    }
+    cache = data;
+    present = true;
+    return true;
+  }
+
+  // Copy the RAM copy into data. Returns false if uninitialized or corrupted.
+  inline bool read(T *data) {
+    load();
+    if (!present) {
+      return false;
+    }
+    *data = cache;
+    return true;
+  }
+
+  // Overloaded version of read.
+  // Returns default-constructed T if validation fails.
+  inline T read() { T data; read(&data); return data; }
+
+  // The RAM copy itself, default-constructed if validation failed.
+  // Stays valid for the lifetime of the instance and follows write().
+  inline const T &ref() { load(); return cache; }
+
+  // Drop the RAM copy after the region was erased or written by other
+  // means, so the next access reloads it from flash
+  inline void invalidate() { storage.invalidate(); loaded = false; }
+
+private:
+  void load() {
+    if (!loaded) {
+      present = storage.read(&cache);
+      if (!present) {
+        cache = T();
+      }
+      loaded = true;
+    }
+  }
+
+  FlashStorageClass<T> storage;
+  T cache;
+  bool loaded;
+  bool present;  // cache holds a valid record
+};
+
+#if defined(__SAMD51__)
+// Hardware SmartEEPROM (SAMD51 only). The SBLK/PSZ user fuses must reserve
+// SmartEEPROM space; the NVM controller then wear-levels byte writes itself.
+class SmartEEPROMClass {
+public:
+  SmartEEPROMClass(uint32_t offset, uint32_t size);
+
+  // Returns true if the fuses enable SmartEEPROM and the range fits inside it
+  bool isAvailable() const;
+
+  // Total virtual SmartEEPROM size configured by the fuses, 0 if disabled
+  static uint32_t capacity();
+
+  // Only bytes that differ from the current contents are written
+  bool write(const void *data) { return write(0, data, size); }
+  bool read(void *data) const;
+
+  // Write n bytes at pos within the range, again skipping unchanged bytes
+  bool write(uint32_t pos, const void *data, uint32_t n);
+
+  // Wait for the controller to finish a pending SmartEEPROM write
+  static void waitReady();
+
+  const volatile uint8_t *address() const { return (const volatile uint8_t *)SEEPROM_ADDR + offset; }
+
+private:
+  const uint32_t offset, size;
+};
+
+// FlashStorageClass equivalent that keeps its record in SmartEEPROM at a fixed
+// byte offset instead of a dedicated flash block. Small writes take
+// microseconds and never trigger a block erase from this library.
+template<class T>
+class SmartEEPROMStorageClass {
+private:
+  typedef FlashStorageInternal::Record<T> Record;
+  
+  SmartEEPROMClass eeprom;
+  uint16_t variable_hash;
+
+public:
+  SmartEEPROMStorageClass(uint32_t offset, uint16_t var_hash)
+    : eeprom(offset, sizeof(typename Record::Format)), variable_hash(var_hash) { };
+
+  // Write data into SmartEEPROM with checksum validation.
+  // Returns true on success, false if SmartEEPROM is not configured or too small.
+  // The record is built in small chunks like FlashStorageClass, and only the
+  // bytes that differ are written, so an unchanged value writes nothing.
+  inline bool write(const T &data) {
+    uint16_t checksum = FlashStorageInternal::calcChecksum((const uint8_t*)&data, sizeof(T));
+    uint8_t chunk[64];
+    for (uint32_t pos = 0, n; pos < sizeof(typename Record::Format); pos += n) {
+      n = sizeof(typename Record::Format) - pos < sizeof(chunk) ? sizeof(typename Record::Format) - pos : sizeof(chunk);
+      Record::fill(chunk, pos, n, variable_hash, data, checksum);
+      if (!eeprom.write(pos, chunk, n)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Read data from SmartEEPROM into variable with validation.
+  // Returns true if valid data found, false if uninitialized or corrupted.
+  inline bool read(T *data) {
+    if (!eeprom.isAvailable()) {
+      return false;  // SmartEEPROM not configured or out of bounds
+    }
+    
+    eeprom.waitReady();
+    if (!Record::isValid(eeprom.address(), variable_hash)) {
+      return false;  // Wrong variable, structure size changed, uninitialized or corrupted
+    }
+    
+    memcpy(data, (const void *)(eeprom.address() + Record::DATA_OFFSET), sizeof(T));
+    return true;
+  }
+
+  // Overloaded version of read.
+  // Returns default-constructed T if validation fails.
+  inline T read() { T data; read(&data); return data; }
+};
+#endif
+
+// Background work registered by storage instances and run by flashIdle()
+struct FlashIdleHook {
+  bool (*run)(void *context);  // Returns true while work remains
+  void *context;
+  FlashIdleHook *next;
+};
+
+namespace FlashStorageInternal {
+  void registerIdleHook(FlashIdleHook *hook);
+}
+
+// Give every storage instance a chance to erase retired flash in the
+// background, one NVM command at a time. Call from loop() or a low-priority
+// tick (never from an ISR). Returns true while background work remains.
+bool flashIdle();
+
+// Same API as FlashStorageClass, but records rotate through a ring of erase
+// units. Every record carries a sequence number so the newest one can be found
+// in any unit; a unit is only erased when the ring wraps back around to it,
+// or ahead of time by idle() when spare units are configured.
+template<class T>
+class FlashStorageRingClass {
 private:
   struct StorageFormat {
-    uint16_t id_hash;  // Hash of variable name + sizeof(T)
+    uint16_t id_hash;   // Hash of variable name + sizeof(T)
+    uint16_t checksum;  // Covers sequence and data
+    uint32_t sequence;  // Increases by one with every record written
     T data;
-    uint16_t checksum;
   };
   
+  static const uint32_t SLOT_SIZE =
+    (sizeof(StorageFormat) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  
   FlashClass flash;
   uint16_t variable_hash;
+  const volatile uint8_t *base;
+  uint32_t unit_size, unit_count, slots_per_unit;
   
-  // Calculate checksum for data validation
-  // Optimized to process 32-bit words for better performance on ARM Cortex-M
-  static uint16_t calcChecksum(const uint8_t* ptr, size_t len) {
-    uint32_t sum = 0xA5A5A5A5;  // 32-bit seed for better mixing
-    
-    // Process full 32-bit words for efficiency
-    size_t words = len >> 2;  // len / 4
-    const uint32_t* ptr32 = (const uint32_t*)ptr;
-    for (size_t i = 0; i < words; i++) {
-      uint32_t word;
-      // Use memcpy to avoid unaligned access issues
-      memcpy(&word, &ptr32[i], sizeof(uint32_t));
-      sum += word;
-      sum ^= (sum >> 16);  // Mix upper and lower halves
+  // Location of the newest record, found by mount() and kept up to date by write()
+  bool mounted;
+  bool has_record;
+  uint32_t head_unit;   // Unit holding the newest record (or the next write)
+  uint32_t head_used;   // Slots used in head_unit
+  uint32_t head_slot;   // Slot of the newest valid record in head_unit
+  uint32_t last_sequence;
+  
+  // Pre-erased spare units following the head unit
+  uint32_t spare_units;     // How many idle() keeps erased
+  uint32_t erased_ahead;    // How many are known to be erased right now
+  bool erase_pending;       // Background erase of the next spare in flight
+  FlashIdleHook idle_hook;
+  
+  static uint16_t checksumOf(const StorageFormat &pkg) {
+    return FlashStorageInternal::calcChecksum((const uint8_t*)&pkg.sequence, sizeof(uint32_t) + sizeof(T));
+  }
+  
+  const volatile uint8_t *slot(uint32_t unit, uint32_t index) const {
+    return base + unit * unit_size + index * SLOT_SIZE;
+  }
+  
+  // Slots in a unit are filled in order, so the used ones form a prefix
+  uint32_t usedSlots(uint32_t unit) {
+    uint32_t lo = 0, hi = slots_per_unit;
+    while (lo < hi) {
+      uint32_t mid = lo + ((hi - lo) >> 1);
+      if (flash.isErased(slot(unit, mid), SLOT_SIZE)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
     }
-    
-    // Process remaining bytes
-    size_t remaining = len & 3;  // len % 4
-    const uint8_t* ptr8 = ptr + (words << 2);
-    for (size_t i = 0; i < remaining; i++) {
-      sum += ptr8[i];
-      sum ^= (sum >> 8);
+    return lo;
+  }
+  
+  bool readSlot(uint32_t unit, uint32_t index, StorageFormat *pkg) {
+    return flash.read(slot(unit, index), pkg, sizeof(StorageFormat)) &&
+           pkg->id_hash == variable_hash &&
+           pkg->checksum == checksumOf(*pkg);
+  }
+  
+  // Same check on the record in place in flash, without copying it
+  bool isValidSlot(uint32_t unit, uint32_t index) {
+    const volatile uint8_t *record = slot(unit, index);
+    return *(const volatile uint16_t *)(record + offsetof(StorageFormat, id_hash)) == variable_hash &&
+           *(const volatile uint16_t *)(record + offsetof(StorageFormat, checksum)) ==
+             FlashStorageInternal::calcChecksum((const uint8_t *)(record + offsetof(StorageFormat, sequence)),
+                                                sizeof(uint32_t) + sizeof(T));
+  }
+  
+  // Scan every unit for the record with the highest sequence number
+  void mount() {
+    StorageFormat pkg;
+    has_record = false;
+    head_unit = 0;
+    head_slot = 0;
+    last_sequence = 0;
+    for (uint32_t unit = 0; unit < unit_count; unit++) {
+      uint32_t used = usedSlots(unit);
+      // Only the newest valid record in each unit can be the overall newest
+      for (uint32_t index = used; index > 0; index--) {
+        if (readSlot(unit, index - 1, &pkg)) {
+          if (!has_record || pkg.sequence > last_sequence) {
+            has_record = true;
+            head_unit = unit;
+            head_slot = index - 1;
+            last_sequence = pkg.sequence;
+          }
+          break;
+        }
+      }
     }
+    head_used = usedSlots(head_unit);
     
-    // Fold 32-bit sum down to 16-bit
-    return (uint16_t)(sum ^ (sum >> 16));
+    // Count the units after the head that are already blank
+    erased_ahead = 0;
+    while (erased_ahead + 1 < unit_count &&
+           flash.isErased(slot((head_unit + erased_ahead + 1) % unit_count, 0), unit_size)) {
+      erased_ahead++;
+    }
+    mounted = true;
+  }
+  
+  // Wait for a background erase to finish before touching flash in the foreground
+  void finishBackgroundErase() {
+    while (flash.poll()) { }
+    if (erase_pending) {
+      erase_pending = false;
+      erased_ahead++;
+    }
+  }
+  
+  static bool runIdle(void *context) {
+    return ((FlashStorageRingClass<T> *)context)->idle();
   }
 
 public:
-  FlashStorageClass(const void *flash_addr, uint16_t var_hash) 
-    : flash(flash_addr, sizeof(StorageFormat)), variable_hash(var_hash) { };
+  // spares is the initial setSpareUnits() value
+  FlashStorageRingClass(const void *flash_addr, uint16_t var_hash, uint32_t unit_bytes, uint32_t units,
+                        uint32_t spares = 0)
+    : flash(flash_addr, unit_bytes * units), variable_hash(var_hash),
+      base((const volatile uint8_t *)flash_addr), unit_size(unit_bytes), unit_count(units),
+      slots_per_unit(unit_bytes / SLOT_SIZE), mounted(false), has_record(false),
+      head_unit(0), head_used(0), head_slot(0), last_sequence(0),
+      spare_units(0), erased_ahead(0), erase_pending(false) {
+    setSpareUnits(spares);
+    idle_hook.run = runIdle;
+    idle_hook.context = this;
+    FlashStorageInternal::registerIdleHook(&idle_hook);
+  };
 
-  // Write data into flash memory with checksum validation.
-  // Compiler is able to optimize parameter copy.
+  // Keep this many units after the current one erased ahead of time, so a
+  // write that moves on to the next unit is a page program only. The erases
+  // happen in idle()/flashIdle(). At most units - 1 spares are kept.
+  void setSpareUnits(uint32_t spares) {
+    spare_units = (spares < unit_count) ? spares : unit_count - 1;
+  }
+
+  // Advance background erasing of retired units by at most one NVM command.
+  // Returns true while erasing is still in progress or still needed.
+  bool idle() {
+    if (flash.poll()) {
+      return true;  // Erase still running
+    }
+    if (erase_pending) {
+      erase_pending = false;
+      erased_ahead++;
+    }
+    if (!mounted) {
+      mount();
+    }
+    if (erased_ahead >= spare_units) {
+      return false;  // Spare pool is full
+    }
+    
+    // The unit after the erased run holds the oldest records; retire it
+    uint32_t unit = (head_unit + erased_ahead + 1) % unit_count;
+    if (flash.beginErase(slot(unit, 0), unit_size)) {
+      erase_pending = true;  // Completes at once if the unit is already blank
+    }
+    return true;  // Either progress was made or the NVM controller was busy
+  }
+
+  // Write data into the next blank slot of the ring.
   // Returns true on success, false on error.
-  // Optimization: Skips erase+write if data hasn't changed (preserves flash endurance).
-  inline bool write(T data) {
+  // Optimization: Skips the write if data hasn't changed (preserves flash endurance).
+  inline bool write(const T &data) {
+    finishBackgroundErase();
+    if (!mounted) {
+      mount();
+    }
+    
+    // Compare against the newest record in place, ignoring its sequence number
+    if (has_record && isValidSlot(head_unit, head_slot) &&
+        memcmp((const void *)(slot(head_unit, head_slot) + offsetof(StorageFormat, data)), &data, sizeof(T)) == 0) {
+      return true;  // Data unchanged, skip write to preserve flash endurance
+    }
+    
     StorageFormat pkg = {};  // Zero-initialize to eliminate padding bytes
     pkg.id_hash = variable_hash;
     pkg.data = data;
-    pkg.checksum = calcChecksum((const uint8_t*)&pkg.data, sizeof(T));
-    
-    // Read existing data to check if write is necessary
-    StorageFormat existing;
-    if (flash.read(&existing)) {
-      // Compare entire structure (including hash and checksum)
-      if (memcmp(&pkg, &existing, sizeof(StorageFormat)) == 0) {
-        return true;  // Data unchanged, skip erase+write to preserve flash endurance
+    pkg.sequence = has_record ? last_sequence + 1 : 0;
+    pkg.checksum = checksumOf(pkg);
+    
+    uint32_t unit = head_unit;
+    uint32_t index = head_used;
+    bool advanced = false;
+    if (index >= slots_per_unit) {
+      // Head unit is full: move to the next unit, which holds the oldest records
+      // unless idle() has already erased it
+      unit = (head_unit + 1) % unit_count;
+      index = 0;
+      advanced = true;
+      if (erased_ahead == 0 && !flash.erase(slot(unit, 0), unit_size)) {
+        return false;
       }
     }
     
-    // Data changed or uninitialized, perform erase+write
-    return flash.erase() && flash.write(&pkg);
+    if (!flash.write(slot(unit, index), &pkg, sizeof(StorageFormat))) {
+      mounted = false;  // Flash state unknown, rescan on next access
+      return false;
+    }
+    
+    if (advanced && erased_ahead > 0) {
+      erased_ahead--;  // The new head unit was one of the spares
+    }
+    has_record = true;
+    head_unit = unit;
+    head_slot = index;
+    head_used = index + 1;
+    last_sequence = pkg.sequence;
+    return true;
   }
 
-  // Read data from flash into variable with validation.
+  // Read the newest valid record from the ring.
   // Returns true if valid data found, false if uninitialized or corrupted.
   inline bool read(T *data) {
-    StorageFormat pkg;
-    if (!flash.read(&pkg)) {
-      return false;  // Read failed or out of bounds
+    finishBackgroundErase();
+    if (!mounted) {
+      mount();
     }
     
-    // Validate variable hash (name + size)
-    if (pkg.id_hash != variable_hash) {
-      return false;  // Wrong variable, structure size changed, or uninitialized
-    }
-    
-    // Validate checksum
-    uint16_t expected = calcChecksum((const uint8_t*)&pkg.data, sizeof(T));
-    if (pkg.checksum != expected) {
-      return false;  // Corrupted data
+    StorageFormat pkg;
+    if (!has_record || !readSlot(head_unit, head_slot, &pkg)) {
+      return false;  // Wrong variable, structure size changed, uninitialized or corrupted
     }
     
     *data = pkg.data;
@@ -184,8 +1042,230 @@ public:
 
   // Overloaded version of read.
   // Returns default-constructed T if validation fails.
-  // Check return value of read(T*) version for explicit validation.
   inline T read() { T data; read(&data); return data; }
 };
 
+// Persistent counter that costs a single program per increment. The low part
+// of the count is a run of cells filling the rest of the erase unit; the high
+// part sits in the unit's header. On SAMD21 a cell is a word of unary bitmap,
+// one cleared bit per increment. SAMD51 may program each 16-byte ECC quad-word
+// only once per erase, so there a cell is a quad-word that one increment
+// programs to zero. When the cells are used up the total moves into the header
+// of the other unit, so the old count stays readable until the new header is
+// complete.
+class FlashCounterClass {
+public:
+  FlashCounterClass(const void *flash_addr, uint16_t var_hash, uint32_t unit_bytes);
+
+  // Add amount to the counter. Returns true on success, false on error.
+  // An uninitialized counter starts from 0.
+  bool increment(uint32_t amount = 1);
+
+  // Returns false if the counter has never been incremented or is corrupted
+  bool read(uint32_t *value);
+
+  // Overloaded version of read. Returns 0 if validation fails.
+  uint32_t read() { uint32_t value = 0; read(&value); return value; }
+
+  // Increments one erase unit absorbs before the count rolls over to the other
+  uint32_t capacity() const { return cell_count * COUNTS_PER_CELL; }
+
+private:
+  struct Header {
+    uint16_t id_hash;   // Hash of variable name + sizeof(uint32_t)
+    uint16_t checksum;  // Covers base
+    uint32_t base;      // Count when this unit's cells were started
+  };
+  
+  // The cells start on the next program granule after the header
+  static const uint32_t HEADER_SIZE =
+    (sizeof(Header) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  
+#if defined(__SAMD51__)
+  static const uint32_t CELL_SIZE = FLASHSTORAGE_WRITE_GRANULE;
+  static const uint32_t COUNTS_PER_CELL = 1;
+#else
+  static const uint32_t CELL_SIZE = 4;
+  static const uint32_t COUNTS_PER_CELL = 32;
+#endif
+  
+  const volatile uint8_t *cell(uint32_t unit, uint32_t index) const {
+    return base_address + unit * unit_size + HEADER_SIZE + index * CELL_SIZE;
+  }
+  
+  bool readHeader(uint32_t unit, Header *header);
+  bool isUsedUp(const volatile uint8_t *cell) const;
+  void mount();
+  bool rollOver(uint32_t new_base);
+  
+  FlashClass flash;
+  uint16_t variable_hash;
+  const volatile uint8_t *base_address;
+  const uint32_t unit_size, cell_count;
+  
+  // Found by mount() and kept up to date by increment()
+  bool mounted;
+  bool valid;
+  uint32_t active_unit;  // Unit holding the newer header
+  uint32_t base;         // Base count from that header
+  uint32_t cell_index;   // First cell that can still take an increment
+};
+
+// Values staged by one FlashTxn, and the RAM kept for them
+#ifndef FLASHTXN_MAX_RECORDS
+  #define FLASHTXN_MAX_RECORDS 8
+#endif
+#ifndef FLASHTXN_MAX_BYTES
+  #define FLASHTXN_MAX_BYTES 256
+#endif
+
+class FlashTxn;
+
+// Several variables sharing two erase units. Each write appends a record for
+// one variable to the current unit, so updating one never erases the others.
+// When the unit is full, the newest record of every variable is copied to the
+// other unit, whose header is written last, so a reset during the copy
+// leaves the old unit in charge. Variables are told apart by the same name
+// and size hash as FlashStorage. A FlashTxn writes several of them at once.
+class FlashStorageGroupClass {
+public:
+  FlashStorageGroupClass(const void *flash_addr, uint32_t unit_bytes);
+
+  // Store length bytes for a variable. Returns true on success, false if the
+  // record doesn't fit or on a flash error.
+  // Optimization: Skips the write if the stored value is unchanged.
+  bool write(uint16_t var_hash, const void *data, uint32_t length);
+
+  // Returns false if the variable has never been written or is corrupted
+  bool read(uint16_t var_hash, void *data, uint32_t length);
+
+private:
+  friend class FlashTxn;
+
+  enum { RECORD_END, RECORD_VALID, RECORD_CORRUPT, RECORD_BROKEN };
+
+  // Flags in the top bits of RecordHeader::length. A transaction writes its
+  // records as staged, then a commit marker holding the offset of the first.
+  static const uint32_t LENGTH_MASK = 0x00FFFFFF;
+  static const uint32_t RECORD_STAGED = 0x80000000;
+  static const uint32_t RECORD_COMMIT = 0x40000000;
+
+  struct UnitHeader {
+    uint16_t magic;
+    uint16_t checksum;    // Covers generation
+    uint32_t generation;  // Increases with every compaction
+  };
+
+  struct RecordHeader {
+    uint16_t id_hash;     // Hash of variable name + sizeof(T)
+    uint16_t checksum;    // Covers id_hash, length and data
+    uint32_t length;      // Data bytes, plus RECORD_STAGED or RECORD_COMMIT
+  };
+
+  // Records start on a program granule, data right after the header
+  static const uint32_t UNIT_HEADER_SIZE =
+    (sizeof(UnitHeader) + FLASHSTORAGE_WRITE_GRANULE - 1) / FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+
+  static uint32_t recordSize(uint32_t length) {
+    return (sizeof(RecordHeader) + length + FLASHSTORAGE_WRITE_GRANULE - 1) /
+           FLASHSTORAGE_WRITE_GRANULE * FLASHSTORAGE_WRITE_GRANULE;
+  }
+  static uint16_t recordChecksum(uint16_t var_hash, const void *data, uint32_t length);
+
+  const volatile uint8_t *unitAddress(uint32_t unit) const { return base_address + unit * unit_size; }
+
+  bool readUnit(uint32_t unit, uint32_t *generation);
+  uint8_t readRecord(uint32_t unit, uint32_t offset, RecordHeader *header);
+  uint32_t find(uint16_t var_hash, uint32_t length);
+  bool isUnchanged(uint16_t var_hash, const void *data, uint32_t length);
+  void mount();
+  bool compact();
+  bool makeRoom(uint32_t size);
+  bool append(uint16_t var_hash, const void *data, uint32_t length, uint32_t flags);
+  bool commit(const FlashTxn &txn);
+
+  FlashClass flash;
+  const volatile uint8_t *base_address;
+  const uint32_t unit_size;
+
+  // Found by mount() and kept up to date by write()
+  bool mounted;
+  bool valid;
+  uint32_t active_unit;
+  uint32_t generation;
+  uint32_t write_offset;
+};
+
+// One variable of a FlashStorageGroup, with the FlashStorageClass API
+template<class T>
+class FlashStorageMemberClass {
+public:
+  FlashStorageMemberClass(FlashStorageGroupClass &group, uint16_t var_hash) : group(group), variable_hash(var_hash) { }
+
+  // Write data into the group's current unit with checksum validation.
+  // Returns true on success, false on error.
+  inline bool write(const T &data) { return group.write(variable_hash, &data, sizeof(T)); }
+
+  // Read the newest valid record. Returns false if uninitialized or corrupted.
+  inline bool read(T *data) { return group.read(variable_hash, data, sizeof(T)); }
+
+  // Overloaded version of read.
+  // Returns default-constructed T if validation fails.
+  inline T read() { T data; read(&data); return data; }
+
+private:
+  friend class FlashTxn;
+
+  FlashStorageGroupClass &group;
+  uint16_t variable_hash;
+};
+
+// Writes new values for several members of one FlashStorageGroup together.
+// Values are staged in RAM and commit() appends them, followed by a commit
+// marker, to the group's current unit, compacting first if they don't all
+// fit. Until the marker is in flash, readers keep seeing the old values, so
+// a reset leaves either all of them or none.
+//
+//   FlashTxn tx;
+//   tx.stage(a, va);
+//   tx.stage(b, vb);
+//   tx.commit();
+class FlashTxn {
+public:
+  FlashTxn() : group(NULL), count(0), used(0), failed(false) { }
+
+  // Queue a value for member; staging a member again replaces its value.
+  // Returns false if the member belongs to another group than the ones
+  // staged before, or FLASHTXN_MAX_RECORDS / FLASHTXN_MAX_BYTES is reached.
+  template<class T> bool stage(FlashStorageMemberClass<T> &member, const T &value) {
+    return stage(member.group, member.variable_hash, &value, sizeof(T));
+  }
+
+  // Write all staged values. Returns false, having written none of them, if
+  // a stage() failed, the values don't fit, or on a flash error. Clears the
+  // transaction either way.
+  bool commit();
+
+  // Drop all staged values
+  void clear();
+
+private:
+  friend class FlashStorageGroupClass;
+
+  struct Entry {
+    uint16_t var_hash;
+    uint16_t offset;      // Value position in buffer
+    uint16_t length;
+  };
+
+  bool stage(FlashStorageGroupClass &member_group, uint16_t var_hash, const void *data, uint32_t length);
+
+  FlashStorageGroupClass *group;
+  Entry entries[FLASHTXN_MAX_RECORDS];
+  uint8_t buffer[FLASHTXN_MAX_BYTES];
+  uint8_t count;
+  uint16_t used;
+  bool failed;
+};
+
 #endif // FLASHSTORAGE_H